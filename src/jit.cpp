@@ -0,0 +1,408 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+
+// =====================================
+//          CODE BUFFER
+// =====================================
+
+#define JIT_CODE_SIZE (1 << 20)
+
+// Longest host sequence emitted for one guest instruction (branch terminator)
+#define JIT_MAX_INSN_CODE 64
+
+/* The buffer is never writable and executable at once (W^X): it is mapped
+   read-write, and translate() switches the pages it writes a block to
+   back to read-execute once the block is emitted.
+*/
+jit_t::jit_t() : code(NULL), capacity(0), used(0), out_of_space(false) {
+#if defined(__x86_64__)
+    void* buffer = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer != MAP_FAILED) {
+        code = (uint8_t*) buffer;
+        capacity = JIT_CODE_SIZE;
+    }
+#endif
+}
+
+jit_t::~jit_t() {
+    if (code)
+        munmap(code, capacity);
+}
+
+void jit_t::reset() {
+    used = 0;
+    out_of_space = false;
+}
+
+#if defined(__x86_64__)
+
+// =====================================
+//          X86-64 EMITTER
+// =====================================
+
+/* Every guest instruction is translated on its own: the operands are loaded
+   from the register array (pointed by rdi) into rax and rcx, combined in rax
+   and stored back. x0 is never written so it keeps reading as zero.
+*/
+typedef struct {
+    uint8_t* cursor;
+} emitter;
+
+static void emit_bytes(emitter* e, const uint8_t* bytes, size_t size) {
+    memcpy(e->cursor, bytes, size);
+    e->cursor += size;
+}
+
+static void emit_u32(emitter* e, uint32_t value) {
+    memcpy(e->cursor, &value, 4);
+    e->cursor += 4;
+}
+
+static void emit_u64(emitter* e, uint64_t value) {
+    memcpy(e->cursor, &value, 8);
+    e->cursor += 8;
+}
+
+// mov rax, [rdi + 8*reg]
+static void emit_load_rax(emitter* e, unsigned reg) {
+    const uint8_t op[] = { 0x48, 0x8b, 0x87 };
+    emit_bytes(e, op, sizeof(op));
+    emit_u32(e, reg * 8);
+}
+
+// mov rcx, [rdi + 8*reg]
+static void emit_load_rcx(emitter* e, unsigned reg) {
+    const uint8_t op[] = { 0x48, 0x8b, 0x8f };
+    emit_bytes(e, op, sizeof(op));
+    emit_u32(e, reg * 8);
+}
+
+// mov [rdi + 8*reg], rax
+static void emit_store_rax(emitter* e, unsigned reg) {
+    const uint8_t op[] = { 0x48, 0x89, 0x87 };
+    emit_bytes(e, op, sizeof(op));
+    emit_u32(e, reg * 8);
+}
+
+// mov rax, imm64
+static void emit_imm_rax(emitter* e, uint64_t value) {
+    const uint8_t op[] = { 0x48, 0xb8 };
+    emit_bytes(e, op, sizeof(op));
+    emit_u64(e, value);
+}
+
+// mov rcx, imm64
+static void emit_imm_rcx(emitter* e, uint64_t value) {
+    const uint8_t op[] = { 0x48, 0xb9 };
+    emit_bytes(e, op, sizeof(op));
+    emit_u64(e, value);
+}
+
+// mov rax, imm64 ; ret
+static void emit_return(emitter* e, uint64_t next_pc) {
+    emit_imm_rax(e, next_pc);
+    const uint8_t op[] = { 0xc3 };
+    emit_bytes(e, op, sizeof(op));
+}
+
+// Host operations combining rax and rcx into rax
+typedef enum {
+    ALU_ADD, ALU_SUB, ALU_AND, ALU_OR, ALU_XOR,
+    ALU_SLL, ALU_SRL, ALU_SRA, ALU_SLT, ALU_SLTU, ALU_MUL,
+    ALU_ADDW, ALU_SUBW, ALU_SLLW, ALU_SRLW, ALU_SRAW, ALU_MULW
+} alu_op;
+
+static void emit_alu(emitter* e, alu_op op) {
+    static const uint8_t add[]  = { 0x48, 0x01, 0xc8 };              // add rax, rcx
+    static const uint8_t sub[]  = { 0x48, 0x29, 0xc8 };              // sub rax, rcx
+    static const uint8_t and_[] = { 0x48, 0x21, 0xc8 };              // and rax, rcx
+    static const uint8_t or_[]  = { 0x48, 0x09, 0xc8 };              // or rax, rcx
+    static const uint8_t xor_[] = { 0x48, 0x31, 0xc8 };              // xor rax, rcx
+    static const uint8_t shl[]  = { 0x48, 0xd3, 0xe0 };              // shl rax, cl
+    static const uint8_t shr[]  = { 0x48, 0xd3, 0xe8 };              // shr rax, cl
+    static const uint8_t sar[]  = { 0x48, 0xd3, 0xf8 };              // sar rax, cl
+    static const uint8_t slt[]  = { 0x48, 0x39, 0xc8,                // cmp rax, rcx
+                                    0x0f, 0x9c, 0xc0,                // setl al
+                                    0x0f, 0xb6, 0xc0 };              // movzx eax, al
+    static const uint8_t sltu[] = { 0x48, 0x39, 0xc8,                // cmp rax, rcx
+                                    0x0f, 0x92, 0xc0,                // setb al
+                                    0x0f, 0xb6, 0xc0 };              // movzx eax, al
+    static const uint8_t mul[]  = { 0x48, 0x0f, 0xaf, 0xc1 };        // imul rax, rcx
+    static const uint8_t addw[] = { 0x01, 0xc8 };                    // add eax, ecx
+    static const uint8_t subw[] = { 0x29, 0xc8 };                    // sub eax, ecx
+    static const uint8_t sllw[] = { 0xd3, 0xe0 };                    // shl eax, cl
+    static const uint8_t srlw[] = { 0xd3, 0xe8 };                    // shr eax, cl
+    static const uint8_t sraw[] = { 0xd3, 0xf8 };                    // sar eax, cl
+    static const uint8_t mulw[] = { 0x0f, 0xaf, 0xc1 };              // imul eax, ecx
+    static const uint8_t sext[] = { 0x48, 0x63, 0xc0 };              // movsxd rax, eax
+
+    switch (op) {
+        case ALU_ADD:  emit_bytes(e, add, sizeof(add)); break;
+        case ALU_SUB:  emit_bytes(e, sub, sizeof(sub)); break;
+        case ALU_AND:  emit_bytes(e, and_, sizeof(and_)); break;
+        case ALU_OR:   emit_bytes(e, or_, sizeof(or_)); break;
+        case ALU_XOR:  emit_bytes(e, xor_, sizeof(xor_)); break;
+        case ALU_SLL:  emit_bytes(e, shl, sizeof(shl)); break;
+        case ALU_SRL:  emit_bytes(e, shr, sizeof(shr)); break;
+        case ALU_SRA:  emit_bytes(e, sar, sizeof(sar)); break;
+        case ALU_SLT:  emit_bytes(e, slt, sizeof(slt)); break;
+        case ALU_SLTU: emit_bytes(e, sltu, sizeof(sltu)); break;
+        case ALU_MUL:  emit_bytes(e, mul, sizeof(mul)); break;
+        // 32-bit operations: x86 masks 32-bit shift amounts to 5 bits like RV64 *W shifts
+        case ALU_ADDW: emit_bytes(e, addw, sizeof(addw)); emit_bytes(e, sext, sizeof(sext)); break;
+        case ALU_SUBW: emit_bytes(e, subw, sizeof(subw)); emit_bytes(e, sext, sizeof(sext)); break;
+        case ALU_SLLW: emit_bytes(e, sllw, sizeof(sllw)); emit_bytes(e, sext, sizeof(sext)); break;
+        case ALU_SRLW: emit_bytes(e, srlw, sizeof(srlw)); emit_bytes(e, sext, sizeof(sext)); break;
+        case ALU_SRAW: emit_bytes(e, sraw, sizeof(sraw)); emit_bytes(e, sext, sizeof(sext)); break;
+        case ALU_MULW: emit_bytes(e, mulw, sizeof(mulw)); emit_bytes(e, sext, sizeof(sext)); break;
+    }
+}
+
+// =====================================
+//          RV64IM DECODING
+// =====================================
+
+#define RV_OPCODE(bits) ((bits) & 0x7f)
+#define RV_RD(bits)     (((bits) >> 7) & 0x1f)
+#define RV_FUNCT3(bits) (((bits) >> 12) & 0x7)
+#define RV_RS1(bits)    (((bits) >> 15) & 0x1f)
+#define RV_RS2(bits)    (((bits) >> 20) & 0x1f)
+#define RV_FUNCT7(bits) ((bits) >> 25)
+
+static int64_t i_imm(uint32_t bits) {
+    return (int64_t) ((int32_t) bits >> 20);
+}
+
+static int64_t u_imm(uint32_t bits) {
+    return (int64_t) (int32_t) (bits & 0xfffff000);
+}
+
+static int64_t b_imm(uint32_t bits) {
+    uint32_t imm = ((bits >> 31) & 1) << 12
+                 | ((bits >> 7) & 1) << 11
+                 | ((bits >> 25) & 0x3f) << 5
+                 | ((bits >> 8) & 0xf) << 1;
+    return (int64_t) ((int32_t) (imm << 19) >> 19);
+}
+
+static int64_t j_imm(uint32_t bits) {
+    uint32_t imm = ((bits >> 31) & 1) << 20
+                 | ((bits >> 12) & 0xff) << 12
+                 | ((bits >> 20) & 1) << 11
+                 | ((bits >> 21) & 0x3ff) << 1;
+    return (int64_t) ((int32_t) (imm << 11) >> 11);
+}
+
+/* Translates a register-register or register-immediate operation writing
+   rd. Returns false for unsupported encodings.
+*/
+static bool translate_alu(emitter* e, uint64_t pc, uint32_t bits) {
+    unsigned rd = RV_RD(bits);
+    unsigned rs1 = RV_RS1(bits);
+    unsigned funct3 = RV_FUNCT3(bits);
+    unsigned funct7 = RV_FUNCT7(bits);
+    alu_op op;
+
+    switch (RV_OPCODE(bits)) {
+        case 0x37: // LUI
+            if (rd) {
+                emit_imm_rax(e, u_imm(bits));
+                emit_store_rax(e, rd);
+            }
+            return true;
+        case 0x17: // AUIPC
+            if (rd) {
+                emit_imm_rax(e, pc + u_imm(bits));
+                emit_store_rax(e, rd);
+            }
+            return true;
+        case 0x13: // OP-IMM
+            switch (funct3) {
+                case 0: op = ALU_ADD; break;
+                case 2: op = ALU_SLT; break;
+                case 3: op = ALU_SLTU; break;
+                case 4: op = ALU_XOR; break;
+                case 6: op = ALU_OR; break;
+                case 7: op = ALU_AND; break;
+                case 1:
+                    if ((bits >> 26) != 0) return false;
+                    op = ALU_SLL;
+                    break;
+                default: // 5
+                    if ((bits >> 26) == 0) op = ALU_SRL;
+                    else if ((bits >> 26) == 0x10) op = ALU_SRA;
+                    else return false;
+                    break;
+            }
+            if (rd) {
+                emit_load_rax(e, rs1);
+                emit_imm_rcx(e, (funct3 == 1 || funct3 == 5) ? (uint64_t) ((bits >> 20) & 0x3f) : (uint64_t) i_imm(bits));
+                emit_alu(e, op);
+                emit_store_rax(e, rd);
+            }
+            return true;
+        case 0x1b: // OP-IMM-32
+            switch (funct3) {
+                case 0: op = ALU_ADDW; break;
+                case 1:
+                    if (funct7 != 0) return false;
+                    op = ALU_SLLW;
+                    break;
+                case 5:
+                    if (funct7 == 0) op = ALU_SRLW;
+                    else if (funct7 == 0x20) op = ALU_SRAW;
+                    else return false;
+                    break;
+                default:
+                    return false;
+            }
+            if (rd) {
+                emit_load_rax(e, rs1);
+                emit_imm_rcx(e, funct3 == 0 ? (uint64_t) i_imm(bits) : (uint64_t) RV_RS2(bits));
+                emit_alu(e, op);
+                emit_store_rax(e, rd);
+            }
+            return true;
+        case 0x33: // OP
+            if (funct7 == 0) {
+                static const alu_op ops[] = { ALU_ADD, ALU_SLL, ALU_SLT, ALU_SLTU, ALU_XOR, ALU_SRL, ALU_OR, ALU_AND };
+                op = ops[funct3];
+            } else if (funct7 == 0x20 && funct3 == 0) {
+                op = ALU_SUB;
+            } else if (funct7 == 0x20 && funct3 == 5) {
+                op = ALU_SRA;
+            } else if (funct7 == 1 && funct3 == 0) {
+                op = ALU_MUL;
+            } else {
+                return false;
+            }
+            break;
+        case 0x3b: // OP-32
+            if (funct7 == 0 && funct3 == 0) op = ALU_ADDW;
+            else if (funct7 == 0 && funct3 == 1) op = ALU_SLLW;
+            else if (funct7 == 0 && funct3 == 5) op = ALU_SRLW;
+            else if (funct7 == 0x20 && funct3 == 0) op = ALU_SUBW;
+            else if (funct7 == 0x20 && funct3 == 5) op = ALU_SRAW;
+            else if (funct7 == 1 && funct3 == 0) op = ALU_MULW;
+            else return false;
+            break;
+        default:
+            return false;
+    }
+
+    // Register-register operations
+    if (rd) {
+        emit_load_rax(e, rs1);
+        emit_load_rcx(e, RV_RS2(bits));
+        emit_alu(e, op);
+        emit_store_rax(e, rd);
+    }
+    return true;
+}
+
+static bool target_aligned(uint64_t target, bool compressed_ok) {
+    return (target & (compressed_ok ? 1 : 3)) == 0;
+}
+
+// =====================================
+//          BLOCK TRANSLATION
+// =====================================
+
+// Emits the host code of a block at e->cursor, returns false if an instruction is not supported
+static bool emit_block(emitter* e, const uint64_t* pcs, const uint32_t* insns, size_t count, bool compressed_ok) {
+    for (size_t i = 0; i < count; i++) {
+        uint64_t pc = pcs[i];
+        uint32_t bits = insns[i];
+        bool last = i == count - 1;
+
+        if ((bits & 3) != 3)
+            return false; // Compressed
+
+        if (RV_OPCODE(bits) == 0x6f) { // JAL
+            uint64_t target = pc + j_imm(bits);
+            if (!target_aligned(target, compressed_ok))
+                return false;
+            if (!last && pcs[i + 1] != target)
+                return false;
+            if (RV_RD(bits)) {
+                emit_imm_rax(e, pc + 4);
+                emit_store_rax(e, RV_RD(bits));
+            }
+            if (last)
+                emit_return(e, target);
+            continue;
+        }
+
+        if (RV_OPCODE(bits) == 0x63) { // BRANCH
+            static const uint8_t jcc[] = { 0x84, 0x85, 0, 0, 0x8c, 0x8d, 0x82, 0x83 };
+            uint64_t target = pc + b_imm(bits);
+            if (!last || jcc[RV_FUNCT3(bits)] == 0 || !target_aligned(target, compressed_ok))
+                return false;
+            emit_load_rax(e, RV_RS1(bits));
+            emit_load_rcx(e, RV_RS2(bits));
+            // cmp rax, rcx ; jcc taken (skips the 11-byte not-taken return)
+            const uint8_t op[] = { 0x48, 0x39, 0xc8, 0x0f, jcc[RV_FUNCT3(bits)], 0x0b, 0x00, 0x00, 0x00 };
+            emit_bytes(e, op, sizeof(op));
+            emit_return(e, pc + 4);
+            emit_return(e, target);
+            continue;
+        }
+
+        if (!translate_alu(e, pc, bits))
+            return false;
+        if (!last && pcs[i + 1] != pc + 4)
+            return false;
+        if (last)
+            emit_return(e, pc + 4);
+    }
+    return true;
+}
+
+jit_block_fn jit_t::translate(const uint64_t* pcs, const uint32_t* insns, size_t count, bool compressed_ok) {
+    if (!code || count == 0)
+        return NULL;
+    size_t bound = (count + 1) * JIT_MAX_INSN_CODE;
+    if (capacity - used < bound) {
+        out_of_space = true;
+        return NULL;
+    }
+
+    // Pages the block may be written to; the first one can hold earlier blocks
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t first = used & ~(page_size - 1);
+    size_t last = (used + bound + page_size - 1) & ~(page_size - 1);
+    if (last > capacity)
+        last = capacity;
+    if (mprotect(code + first, last - first, PROT_READ | PROT_WRITE) != 0)
+        return NULL;
+
+    emitter e = { code + used };
+    bool emitted = emit_block(&e, pcs, insns, count, compressed_ok);
+
+    if (mprotect(code + first, last - first, PROT_READ | PROT_EXEC) != 0) {
+        /* The earlier blocks of the page cannot run either: drop the buffer
+           and report it full so the caller forgets every translation. */
+        munmap(code, capacity);
+        code = NULL;
+        capacity = 0;
+        used = 0;
+        out_of_space = true;
+        return NULL;
+    }
+    if (!emitted)
+        return NULL;
+    jit_block_fn fn = (jit_block_fn) (code + used);
+    used = e.cursor - code;
+    return fn;
+}
+
+#else
+
+jit_block_fn jit_t::translate(const uint64_t*, const uint32_t*, size_t, bool) {
+    return NULL;
+}
+
+#endif
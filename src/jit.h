@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// =====================================
+//        NATIVE BLOCK TRANSLATION
+// =====================================
+
+/* Translated block: runs the block on the 32 integer registers and returns
+   the PC of the next instruction to execute.
+*/
+typedef uint64_t (*jit_block_fn)(uint64_t* xpr);
+
+/* Translator of straight-line RV64IM blocks to x86-64 host code. Only
+   instructions that cannot trap and only touch the integer registers are
+   supported (ALU operations, multiplications, direct jumps and branches).
+   Anything else (memory accesses, CSRs, FP, atomics, divisions, compressed
+   instructions) makes the translation fail and the block is left to Spike.
+   On other hosts every translation fails.
+*/
+class jit_t {
+public:
+    jit_t();
+    ~jit_t();
+    jit_t(const jit_t&) = delete;
+    jit_t& operator=(const jit_t&) = delete;
+
+    /* Translates the count instructions insns[i] found at pcs[i]. Only the
+       last instruction may be a branch, jal is also allowed in the middle
+       (the block continues at its target). compressed_ok tells if 2-byte
+       aligned jump targets are legal. Returns NULL if the block cannot be
+       translated or the code buffer is full (see full()).
+    */
+    jit_block_fn translate(const uint64_t* pcs, const uint32_t* insns, size_t count, bool compressed_ok);
+
+    // True once a translation failed for lack of space, reset() then frees it
+    bool full() { return out_of_space; }
+    // Drops every translation
+    void reset();
+
+private:
+    uint8_t* code;      // Code buffer, read-execute except while a block is emitted
+    size_t capacity;
+    size_t used;
+    bool out_of_space;
+};
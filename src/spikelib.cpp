@@ -1,17 +1,919 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include "processor.h"
 #include "devices.h"
 #include "memif.h"
 #include "mmu.h"
+#include "memtracer.h"
 #include "sim.h"
 #include "trap.h"
 #include "config.h"
+#include "jit.h"
 #include "spikelib.h"
 
+// =====================================
+//          SIMULATOR STATE
+// =====================================
+
+// Host buffer backing a guest memory region, as given to initialize_sim
+typedef struct {
+    reg_t base;
+    reg_t size;
+    char* content;
+    mem_t* mem;
+    bool sparse;        // content is a mapping owned by the library (region given without content)
+} host_region;
+
+/* Reserves the content of a region given without one: an anonymous private
+   mapping without swap reservation, whose pages the kernel only commits
+   (zeroed) on their first access. Transparent huge pages are refused, so
+   that a first access commits one page and not 2 MiB. Returns NULL on
+   failure.
+*/
+static char* map_sparse_content(reg_t size) {
+    void* content = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (content == MAP_FAILED) return NULL;
+    // Fails without THP support in the kernel, pages are small anyway then
+    madvise(content, size, MADV_NOHUGEPAGE);
+    return (char*) content;
+}
+
+/* Page-granular record of writes to the host regions, fed by Spike's memory
+   tracer. Pages are stamped with the epoch of their last write. While a page
+   is not stamped with the current epoch the tracer keeps it out of the TLB,
+   so its first store goes through the MMU slow path and gets recorded. Later
+   stores in the same epoch run at full speed. Host writes are stamped by
+   write_memory. Starting an epoch requires a TLB flush to re-arm the pages.
+   Guest stores are also stamped in a second table with the dirty epoch
+   (get_dirty_pages), which host writes and snapshots leave alone.
+   The tracer is shared by the MMUs of all harts, stamps are accessed atomically.
+*/
+class write_tracker_t : public memtracer_t {
+public:
+    write_tracker_t(std::vector<host_region>* regions) : regions(regions), epoch(1), enabled(false), dirty_epoch(1) {
+        for (host_region& region : *regions) {
+            stamps.push_back(std::vector<uint32_t>((region.size + PGSIZE - 1) >> PGSHIFT, 0));
+        }
+        dirty = stamps;
+    }
+
+    bool interested_in_range(uint64_t begin, uint64_t end, access_type type) {
+        if (type != STORE || end <= begin) return false;
+        for (size_t i = 0; i < regions->size(); i++) {
+            host_region& region = (*regions)[i];
+            if (end <= region.base || begin >= region.base + region.size) continue;
+            reg_t first = (std::max(begin, region.base) - region.base) >> PGSHIFT;
+            reg_t last  = (std::min(end, region.base + region.size) - 1 - region.base) >> PGSHIFT;
+            for (reg_t page = first; page <= last; page++) {
+                if (enabled && __atomic_load_n(&stamps[i][page], __ATOMIC_RELAXED) != epoch) return true;
+                if (__atomic_load_n(&dirty[i][page], __ATOMIC_RELAXED) != dirty_epoch) return true;
+            }
+        }
+        return false;
+    }
+
+    void trace(uint64_t addr, size_t bytes, access_type type) {
+        if (type == STORE) {
+            stamp(addr, bytes);
+            stamp_pages(dirty, dirty_epoch, addr, bytes);
+        }
+    }
+
+    // Stamps the pages of [address, address + size) with the current epoch
+    void stamp(reg_t address, reg_t size) {
+        if (enabled) stamp_pages(stamps, epoch, address, size);
+    }
+
+    std::vector<host_region>* regions;
+    std::vector<std::vector<uint32_t>> stamps; // Per region, per page: epoch of the last write
+    uint32_t epoch;                            // Current epoch
+    bool enabled;                              // Tracking is only paid for once a snapshot exists
+    std::vector<std::vector<uint32_t>> dirty;  // Per region, per page: dirty epoch of the last guest store
+    uint32_t dirty_epoch;                      // Current dirty epoch (clear_dirty_pages)
+
+private:
+    void stamp_pages(std::vector<std::vector<uint32_t>>& table, uint32_t value, reg_t address, reg_t size) {
+        if (size == 0) return;
+        for (size_t i = 0; i < regions->size(); i++) {
+            host_region& region = (*regions)[i];
+            if (address + size <= region.base || address >= region.base + region.size) continue;
+            reg_t first = (std::max(address, region.base) - region.base) >> PGSHIFT;
+            reg_t last  = (std::min(address + size, region.base + region.size) - 1 - region.base) >> PGSHIFT;
+            for (reg_t page = first; page <= last; page++) {
+                __atomic_store_n(&table[i][page], value, __ATOMIC_RELAXED);
+            }
+        }
+    }
+};
+
+// Flag of the page permission table set on mapped pages, next to their spike_prot bits
+#define PAGE_MAPPED (1 << 3)
+
+// Range of pages sharing the same PMP permissions
+typedef struct {
+    reg_t begin;
+    reg_t end;
+    uint8_t cfg;
+} pmp_range;
+
+/* Flat per-page permission table of the host regions (mem_map, mem_unmap,
+   mem_protect), every page starts mapped with all permissions. Spike
+   enforces it with the physical memory protection of the harts: the pages
+   that lack a permission are compiled into locked TOR entries, which the
+   MMU checks on its slow path before the access and which also bind
+   machine mode. Fully accessible pages need no entry and keep their TLB
+   entries. The table then tells protection faults from unmapped accesses.
+*/
+class memory_map_t {
+public:
+    memory_map_t(std::vector<host_region>* regions) : regions(regions), restricted(false) {
+        for (host_region& region : *regions) {
+            pages.push_back(std::vector<uint8_t>((region.size + PGSIZE - 1) >> PGSHIFT, PAGE_MAPPED | SPIKE_PROT_ALL));
+        }
+    }
+
+    /* Sets the flags of the pages of [address, address + size), which must
+       be page-aligned, covered by page-aligned regions and all mapped
+       (was_mapped) or all unmapped. Returns false (and changes nothing)
+       otherwise.
+    */
+    bool set(reg_t address, reg_t size, uint8_t flags, bool was_mapped) {
+        if (size == 0 || (address | size) % PGSIZE != 0 || address + size < address) return false;
+        for (int pass = 0; pass < 2; pass++) {
+            for (reg_t page = address; page != address + size; page += PGSIZE) {
+                uint8_t* entry = find(page);
+                if (entry == NULL || ((*entry & PAGE_MAPPED) != 0) != was_mapped) return false;
+                if (pass == 1) *entry = flags;
+            }
+        }
+        restricted = false;
+        for (std::vector<uint8_t>& region_pages : pages) {
+            for (uint8_t entry : region_pages) {
+                restricted |= entry != (PAGE_MAPPED | SPIKE_PROT_ALL);
+            }
+        }
+        return true;
+    }
+
+    // True if every page of [address, address + size) is mapped (pages outside the regions count as mapped)
+    bool mapped(reg_t address, reg_t size) {
+        if (!restricted || size == 0) return true;
+        for (reg_t page = address & ~reg_t(PGSIZE - 1); page <= address + size - 1; page += PGSIZE) {
+            uint8_t* entry = find(page);
+            if (entry != NULL && !(*entry & PAGE_MAPPED)) return false;
+        }
+        return true;
+    }
+
+    /* Error of an access fault on address, given as the *_UNMAPPED code of
+       the access: the matching *_PROT code if the page is mapped, the code
+       itself otherwise.
+    */
+    sp_err access_error(sp_err unmapped_error, reg_t address) {
+        if (!restricted) return unmapped_error;
+        uint8_t* entry = find(address & ~reg_t(PGSIZE - 1));
+        if (entry == NULL || !(*entry & PAGE_MAPPED)) return unmapped_error;
+        switch (unmapped_error) {
+            case SP_ERR_READ_UNMAPPED:  return SP_ERR_READ_PROT;
+            case SP_ERR_WRITE_UNMAPPED: return SP_ERR_WRITE_PROT;
+            case SP_ERR_FETCH_UNMAPPED: return SP_ERR_FETCH_PROT;
+            default:                    return unmapped_error;
+        }
+    }
+
+    /* Compiles the table into PMP entries (pmpaddr, pmpcfg), in increasing
+       address order. Each range of pages lacking the same permissions takes
+       a TOR entry, plus an entry holding its base when it does not start
+       where the previous one ends.
+    */
+    std::vector<std::pair<reg_t, uint8_t>> pmp_entries() {
+        std::vector<pmp_range> ranges;
+        for (size_t i = 0; i < regions->size(); i++) {
+            reg_t base = (*regions)[i].base;
+            for (reg_t page = 0; page < pages[i].size(); page++) {
+                uint8_t entry = pages[i][page];
+                if (entry == (PAGE_MAPPED | SPIKE_PROT_ALL)) continue;
+                uint8_t cfg = PMP_TOR | PMP_L;
+                if (entry & PAGE_MAPPED) {
+                    if (entry & SPIKE_PROT_READ)  cfg |= PMP_R;
+                    if (entry & SPIKE_PROT_WRITE) cfg |= PMP_W;
+                    if (entry & SPIKE_PROT_EXEC)  cfg |= PMP_X;
+                }
+                reg_t begin = base + (page << PGSHIFT);
+                if (!ranges.empty() && ranges.back().end == begin && ranges.back().cfg == cfg) {
+                    ranges.back().end += PGSIZE;
+                } else {
+                    ranges.push_back({ .begin = begin, .end = begin + PGSIZE, .cfg = cfg });
+                }
+            }
+        }
+        std::sort(ranges.begin(), ranges.end(), [](const pmp_range& a, const pmp_range& b) { return a.begin < b.begin; });
+        std::vector<std::pair<reg_t, uint8_t>> entries;
+        reg_t top = 0;
+        for (const pmp_range& range : ranges) {
+            if (range.begin != top) {
+                entries.push_back(std::make_pair(range.begin >> PMP_SHIFT, uint8_t(0)));
+            }
+            entries.push_back(std::make_pair(range.end >> PMP_SHIFT, range.cfg));
+            top = range.end;
+        }
+        return entries;
+    }
+
+    std::vector<host_region>* regions;
+    std::vector<std::vector<uint8_t>> pages;   // Per region, per page: PAGE_MAPPED and spike_prot bits
+    bool restricted;                           // Some page is unmapped or lacks a permission
+
+private:
+    // Entry of the page at address, NULL if no page-aligned region holds it
+    uint8_t* find(reg_t address) {
+        for (size_t i = 0; i < regions->size(); i++) {
+            host_region& region = (*regions)[i];
+            if (region.base % PGSIZE == 0 && address >= region.base && address - region.base < region.size) {
+                return &pages[i][(address - region.base) >> PGSHIFT];
+            }
+        }
+        return NULL;
+    }
+};
+
+// Guest range whose loads and/or stores stop the run (add_watchpoint)
+typedef struct {
+    reg_t address;
+    reg_t size;
+    int kind;           // Mask of spike_watch_kind
+} watchpoint;
+
+// Watchpoints of a simulator, with the kinds watched on each page they cover
+typedef struct {
+    std::vector<watchpoint> ranges;
+    std::unordered_map<reg_t, int> pages;
+} watch_list;
+
+/* Memory tracer of one hart stopping it on watched accesses. Watched pages
+   are kept out of the TLB for the watched access kinds, so their accesses
+   go through the MMU slow path and reach trace(); other pages pay nothing.
+   A hit raises a breakpoint exception with the address in tval, as Spike's
+   debug triggers do, after a store has been written and before a load
+   writes its destination. The run loop then undoes the trap so the guest
+   trap CSRs stay as they were, and the next run starting on the accessing
+   instruction runs it with the tracer disarmed. Host accesses never hit:
+   the tracer is only armed while the hart runs.
+*/
+class watch_tracer_t : public memtracer_t {
+public:
+    watch_tracer_t() : watches(NULL), armed(false), pending(false), hit_address(0), hit_kind(0), step_over(false), hit_pc(0) {}
+
+    bool interested_in_range(uint64_t begin, uint64_t end, access_type type) {
+        if (type == FETCH || watches == NULL || watches->pages.empty() || end <= begin) return false;
+        int kind = (type == LOAD) ? SPIKE_WATCH_READ : SPIKE_WATCH_WRITE;
+        for (reg_t page = begin >> PGSHIFT; page <= (end - 1) >> PGSHIFT; page++) {
+            auto watched = watches->pages.find(page);
+            if (watched != watches->pages.end() && (watched->second & kind)) return true;
+        }
+        return false;
+    }
+
+    void trace(uint64_t addr, size_t bytes, access_type type) {
+        if (!armed || type == FETCH) return;
+        int kind = (type == LOAD) ? SPIKE_WATCH_READ : SPIKE_WATCH_WRITE;
+        for (watchpoint& range : watches->ranges) {
+            if ((range.kind & kind) && addr < range.address + range.size && range.address < addr + bytes) {
+                pending     = true;
+                hit_address = addr;
+                hit_kind    = kind;
+                throw trap_breakpoint(addr);
+            }
+        }
+    }
+
+    watch_list* watches;
+    bool armed;             // Set while the hart runs
+    bool pending;           // A hit not yet reported by the run loop
+    reg_t hit_address;      // Last access that hit
+    int hit_kind;
+    bool step_over;         // The next run starting on hit_pc runs it unwatched
+    reg_t hit_pc;           // Instruction of the last hit
+};
+
+// Callback installed with hook_add
+typedef struct {
+    uint64_t id;
+    int type;           // Mask of spike_hook_type
+    void* callback;
+    void* user_data;
+    reg_t begin;
+    reg_t end;          // Inclusive, begin > end covers every address
+} hook;
+
+// True if the hook's range meets [begin, end]
+static inline bool hook_covers(const hook& installed, reg_t begin, reg_t end) {
+    return installed.begin > installed.end || (begin <= installed.end && installed.begin <= end);
+}
+
+/* Memory tracer of one hart calling the memory read and write hooks. Like
+   the watch tracer, it keeps the hooked pages out of the TLB so that only
+   their accesses are traced, and is only armed while the hart runs. The
+   callbacks get the value accessed (first 8 bytes) read back from the host
+   region, after the access.
+*/
+class hook_tracer_t : public memtracer_t {
+public:
+    hook_tracer_t() : hooks(NULL), regions(NULL), handle(NULL), armed(false) {}
+
+    bool interested_in_range(uint64_t begin, uint64_t end, access_type type) {
+        if (type == FETCH || hooks == NULL || end <= begin) return false;
+        int wanted = (type == LOAD) ? SPIKE_HOOK_MEM_READ : SPIKE_HOOK_MEM_WRITE;
+        for (const hook& installed : *hooks) {
+            if ((installed.type & wanted) && hook_covers(installed, begin, end - 1)) return true;
+        }
+        return false;
+    }
+
+    void trace(uint64_t addr, size_t bytes, access_type type) {
+        if (!armed || type == FETCH) return;
+        int wanted = (type == LOAD) ? SPIKE_HOOK_MEM_READ : SPIKE_HOOK_MEM_WRITE;
+        uint64_t value = 0;
+        for (host_region& region : *regions) {
+            if (addr >= region.base && addr - region.base < region.size) {
+                memcpy(&value, region.content + (addr - region.base), std::min<reg_t>(std::min<size_t>(bytes, 8), region.size - (addr - region.base)));
+                break;
+            }
+        }
+        // Indexed loop on a copy: callbacks may add or delete hooks
+        for (size_t i = 0; i < hooks->size(); i++) {
+            hook installed = (*hooks)[i];
+            if ((installed.type & wanted) && hook_covers(installed, addr, addr + bytes - 1)) {
+                ((spike_hook_mem_cb) installed.callback)(handle, wanted, addr, bytes, value, installed.user_data);
+            }
+        }
+    }
+
+    std::vector<hook>* hooks;
+    std::vector<host_region>* regions;
+    void* handle;       // Simulator handle given to the callbacks
+    bool armed;
+};
+
+// Bits of the page filter of the breakpoint set (power of two)
+#define BREAKPOINT_FILTER_BITS 4096
+
+/* Addresses stopping a run (add_breakpoint). Lookups first test a bitmap
+   indexed by a hash of the page, which is enough to reject code far from
+   any breakpoint; only pages flagged there reach the hash set.
+*/
+class breakpoint_set_t {
+public:
+    breakpoint_set_t() : filter(BREAKPOINT_FILTER_BITS / 64, 0) {}
+
+    inline bool contains(reg_t pc) const {
+        if (addresses.empty()) return false;
+        size_t bit = (pc >> PGSHIFT) & (BREAKPOINT_FILTER_BITS - 1);
+        if ((filter[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) return false;
+        return addresses.count(pc) != 0;
+    }
+
+    void insert(reg_t pc) {
+        addresses.insert(pc);
+        rebuild_filter();
+    }
+
+    bool erase(reg_t pc) {
+        if (addresses.erase(pc) == 0) return false;
+        rebuild_filter();
+        return true;
+    }
+
+    void clear() {
+        addresses.clear();
+        rebuild_filter();
+    }
+
+private:
+    void rebuild_filter() {
+        std::fill(filter.begin(), filter.end(), 0);
+        for (reg_t pc : addresses) {
+            size_t bit = (pc >> PGSHIFT) & (BREAKPOINT_FILTER_BITS - 1);
+            filter[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+    }
+
+    std::unordered_set<reg_t> addresses;
+    std::vector<uint64_t> filter;
+};
+
+// Number of entries of the per-hart block cache (direct-mapped on the PC)
+#define BLOCK_CACHE_ENTRIES 4096
+
+// Straight-line block of instructions starting at pc, run in one step() call
+typedef struct {
+    reg_t pc;
+    reg_t end_address;  // Stop address the block was cut for
+    size_t length;      // Number of instructions
+    bool cacheable;     // False if the last fetch faulted
+    bool fence_i;       // Ends with fence.i (guest code changed)
+    uint32_t hits;      // Full executions counted towards JIT_HOT_THRESHOLD
+    jit_block_fn native; // Host translation, NULL if none
+    std::vector<uint32_t> insns; // Instruction bits along the block, only kept for the JIT
+} cached_block;
+
+static const cached_block EMPTY_BLOCK = { .pc = ~reg_t(0), .end_address = 0, .length = 0, .cacheable = false, .fence_i = false, .hits = 0, .native = NULL, .insns = {} };
+
+/* Execution profile of a hart: number of times each block prefix ran,
+   keyed on its start pc, the number of instructions retired and the pc it
+   left to. The run loop does one increment per block; per-pc and per-edge
+   counts are derived when the profile is exported. Open addressing with
+   linear probing, the capacity is a power of two kept under 3/4 full.
+*/
+#define PROFILE_NO_EDGE (~reg_t(0))
+
+typedef struct {
+    reg_t pc;           // Block start, ~0 for an empty slot
+    reg_t next_pc;      // PC after the block, PROFILE_NO_EDGE if it trapped
+    uint64_t length;    // Instructions retired
+    uint64_t count;
+} profile_entry;
+
+class profile_table_t {
+public:
+    profile_table_t() : used(0) {}
+
+    void record(reg_t pc, reg_t length, reg_t next_pc) {
+        if ((used + 1) * 4 > entries.size() * 3) grow();
+        size_t mask = entries.size() - 1;
+        size_t index = hash(pc, length, next_pc) & mask;
+        while (true) {
+            profile_entry& entry = entries[index];
+            if (entry.pc == pc && entry.length == length && entry.next_pc == next_pc) {
+                entry.count++;
+                return;
+            }
+            if (entry.pc == ~reg_t(0)) {
+                entry = { .pc = pc, .next_pc = next_pc, .length = length, .count = 1 };
+                used++;
+                return;
+            }
+            index = (index + 1) & mask;
+        }
+    }
+
+    void clear() {
+        entries.clear();
+        used = 0;
+    }
+
+    std::vector<profile_entry> entries;
+    size_t used;
+
+private:
+    static size_t hash(reg_t pc, reg_t length, reg_t next_pc) {
+        uint64_t h = pc * 0x9e3779b97f4a7c15ULL ^ next_pc * 0xc2b2ae3d27d4eb4fULL ^ length;
+        return h ^ (h >> 29);
+    }
+
+    void grow() {
+        std::vector<profile_entry> old;
+        old.swap(entries);
+        profile_entry empty = { .pc = ~reg_t(0), .next_pc = 0, .length = 0, .count = 0 };
+        entries.assign(old.empty() ? 1024 : old.size() * 2, empty);
+        size_t mask = entries.size() - 1;
+        for (profile_entry& entry : old) {
+            if (entry.pc == ~reg_t(0)) continue;
+            size_t index = hash(entry.pc, entry.length, entry.next_pc) & mask;
+            while (entries[index].pc != ~reg_t(0)) index = (index + 1) & mask;
+            entries[index] = entry;
+        }
+    }
+};
+
+// Records of the ring buffer between the run loop and the trace writer (power of two)
+#define TRACE_RING_RECORDS (1 << 16)
+// Bytes of the trace file mapped at a time (multiple of the record size and page size)
+#define TRACE_FILE_WINDOW (64 << 20)
+
+/* Instruction trace of a hart streamed to a file (format in spikelib.h).
+   The run loop pushes records into a single-producer single-consumer ring
+   buffer without locks; a background thread drains it into a window of the
+   file mapped in memory, moving the window forward as the file grows. The
+   producer waits when the ring is full so no record is lost.
+*/
+class trace_writer_t {
+public:
+    // Returns NULL if the file cannot be created
+    static trace_writer_t* create(const char* path) {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return NULL;
+        trace_writer_t* writer = new trace_writer_t(fd);
+        if (!writer->map_window(0)) {
+            delete writer;
+            return NULL;
+        }
+        writer->cursor = sizeof(spike_trace_header);
+        writer->drainer = std::thread(&trace_writer_t::drain, writer);
+        return writer;
+    }
+
+    ~trace_writer_t() {
+        finish();
+    }
+
+    /* Drains the ring, writes the header and closes the file. Returns false
+       if some records could not be written.
+    */
+    bool finish() {
+        if (fd < 0) return !failed;
+        if (drainer.joinable()) {
+            stopping.store(true, std::memory_order_release);
+            drainer.join();
+        }
+        if (window != NULL) munmap(window, TRACE_FILE_WINDOW);
+        window = NULL;
+        spike_trace_header header;
+        memcpy(header.magic, SPIKE_TRACE_MAGIC, sizeof(header.magic));
+        header.version        = SPIKE_TRACE_VERSION;
+        header.record_size    = sizeof(spike_trace_record);
+        header.records_number = written;
+        header.reserved       = 0;
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) failed = true;
+        if (ftruncate(fd, sizeof(header) + written * sizeof(spike_trace_record)) != 0) failed = true;
+        close(fd);
+        fd = -1;
+        return !failed;
+    }
+
+    void push(const spike_trace_record& record) {
+        size_t position = head.load(std::memory_order_relaxed);
+        while (position - tail.load(std::memory_order_acquire) == TRACE_RING_RECORDS) {
+            std::this_thread::yield();
+        }
+        ring[position & (TRACE_RING_RECORDS - 1)] = record;
+        head.store(position + 1, std::memory_order_release);
+    }
+
+    // Set if records could not be written (file system full, mapping failure)
+    std::atomic<bool> failed;
+
+private:
+    trace_writer_t(int fd)
+        : failed(false), fd(fd), ring(TRACE_RING_RECORDS), head(0), tail(0), stopping(false),
+          window(NULL), window_offset(0), cursor(0), written(0) {}
+
+    // Maps TRACE_FILE_WINDOW bytes of the file from offset, growing the file to cover them
+    bool map_window(off_t offset) {
+        if (window != NULL) munmap(window, TRACE_FILE_WINDOW);
+        window = NULL;
+        if (ftruncate(fd, offset + TRACE_FILE_WINDOW) != 0) return false;
+        void* mapped = mmap(NULL, TRACE_FILE_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+        if (mapped == MAP_FAILED) return false;
+        window = (char*) mapped;
+        window_offset = offset;
+        cursor = 0;
+        return true;
+    }
+
+    void drain() {
+        while (true) {
+            bool last_round = stopping.load(std::memory_order_acquire);
+            size_t position = tail.load(std::memory_order_relaxed);
+            size_t end = head.load(std::memory_order_acquire);
+            if (position == end) {
+                if (last_round) return;
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            for (; position != end; position++) {
+                if (cursor == TRACE_FILE_WINDOW && !map_window(window_offset + TRACE_FILE_WINDOW)) {
+                    failed = true;
+                }
+                if (window == NULL) continue;
+                memcpy(window + cursor, &ring[position & (TRACE_RING_RECORDS - 1)], sizeof(spike_trace_record));
+                cursor += sizeof(spike_trace_record);
+                written++;
+            }
+            tail.store(position, std::memory_order_release);
+        }
+    }
+
+    int fd;
+    std::vector<spike_trace_record> ring;
+    std::atomic<size_t> head;       // Next record pushed (run loop)
+    std::atomic<size_t> tail;       // Next record drained (drain thread)
+    std::atomic<bool> stopping;
+    std::thread drainer;
+    char* window;                   // Mapped part of the file
+    off_t window_offset;
+    size_t cursor;                  // Write position in the window
+    uint64_t written;               // Records in the file
+};
+
+// Run engine state kept per hart (each hart has its own instruction cache)
+typedef struct {
+    // Pages fetched as code since the last instruction cache flush
+    std::unordered_set<reg_t> executed_pages;
+    // Decoded blocks, only valid for pages in executed_pages
+    std::vector<cached_block> blocks = std::vector<cached_block>(BLOCK_CACHE_ENTRIES, EMPTY_BLOCK);
+    // Last block that could not be cached
+    cached_block uncached = EMPTY_BLOCK;
+    // Native translations of hot blocks, created on first use
+    std::unique_ptr<jit_t> jit;
+    uint64_t jit_translations = 0;
+    uint64_t jit_native_runs = 0;
+    uint64_t jit_mismatches = 0;
+    // Execution profile, only fed while the simulator profiles
+    profile_table_t profile;
+    // Instruction trace, NULL when the hart is not traced
+    std::unique_ptr<trace_writer_t> tracer;
+    // Watchpoint checks of the hart's MMU
+    watch_tracer_t watcher;
+    // Address of the last breakpoint the hart stopped on
+    reg_t hit_breakpoint = 0;
+    // Memory hooks of the hart's MMU
+    hook_tracer_t mem_hooks;
+    // End address of the last spike_start, kept for spike_resume
+    reg_t run_end_address = ~reg_t(0);
+    // Instructions and time run since the last spike_start, resumes included
+    uint64_t run_instructions = 0;
+    uint64_t run_time_us = 0;
+} hart_context;
+
+// Symbol of an ELF file loaded with load_elf
+typedef struct {
+    reg_t address;
+    reg_t size;         // 0 for labels
+    std::string name;
+} elf_symbol;
+
+// Forgets the decoded code of a hart, along with Spike's instruction cache
+static void flush_hart_code(processor_t* core, hart_context& hart) {
+    core->get_mmu()->flush_icache();
+    hart.executed_pages.clear();
+    std::fill(hart.blocks.begin(), hart.blocks.end(), EMPTY_BLOCK);
+    if (hart.jit) {
+        hart.jit->reset();
+    }
+}
+
+/* Simulator handed out through the FFI. It is a sim_t (the void* given to
+   the host points to the sim_t base) extended with the state spikelib keeps
+   per simulator. The constructor forwards everything else to sim_t.
+*/
+class spikelib_sim_t : public sim_t {
+public:
+    template <typename... Args>
+    spikelib_sim_t(std::vector<host_region> regions, Args&&... args)
+        : sim_t(std::forward<Args>(args)...), regions(regions), writes(&this->regions), memory(&this->regions), harts(nprocs()) {
+        for (size_t i = 0; i < nprocs(); i++) {
+            get_core(i)->get_mmu()->register_memtracer(&writes);
+            harts[i].watcher.watches = &watches;
+            get_core(i)->get_mmu()->register_memtracer(&harts[i].watcher);
+            harts[i].mem_hooks.hooks   = &hooks;
+            harts[i].mem_hooks.regions = &this->regions;
+            harts[i].mem_hooks.handle  = static_cast<void*>((sim_t*) this);
+            get_core(i)->get_mmu()->register_memtracer(&harts[i].mem_hooks);
+        }
+    }
+
+    ~spikelib_sim_t() {
+        stop_async_run();
+        for (host_region& region : regions) {
+            if (region.sparse) {
+                munmap(region.content, region.size);
+            }
+        }
+    }
+
+    std::vector<host_region> regions;
+    write_tracker_t writes;
+    // Page permissions (mem_map, mem_unmap, mem_protect)
+    memory_map_t memory;
+    // Key of the pool the simulator is recycled into (ISA and memory layout)
+    std::string pool_key;
+    std::vector<hart_context> harts;
+    // Native translation tier (spike_jit_mode)
+    int jit_mode = SPIKE_JIT_OFF;
+    // Execution profiling (spike_profile_enable)
+    bool profiling = false;
+    watch_list watches;
+    breakpoint_set_t breakpoints;
+    // Hooks (hook_add) and the mask of their types
+    std::vector<hook> hooks;
+    int hook_types = 0;
+    uint64_t next_hook_id = 1;
+    // Symbols of the ELF files loaded (load_elf), sorted by address, and their indices sorted by name
+    std::vector<elf_symbol> symbols;
+    std::vector<size_t> symbols_by_name;
+    // Set by spike_stop, checked by the run loop at each block
+    std::atomic<bool> stop_requested{false};
+    // Asynchronous run (spike_start_async), its result is valid once async_finished is set
+    std::thread async_worker;
+    bool async_started = false;
+    std::atomic<bool> async_finished{false};
+    int async_result = SP_ERR_UNKNOWN;
+
+    // Stops the asynchronous run, if any, and waits for its thread
+    void stop_async_run() {
+        if (async_worker.joinable()) {
+            stop_requested.store(true);
+            async_worker.join();
+        }
+    }
+};
+
+static inline spikelib_sim_t* get_spikelib_sim(void* sim) {
+    return static_cast<spikelib_sim_t*>((sim_t*) sim);
+}
+
+/* Returns the symbol holding address: the last one starting at or before it,
+   unless it has a size that ends before. NULL if there is none.
+*/
+static const elf_symbol* find_address_symbol(spikelib_sim_t* sim, reg_t address) {
+    auto next = std::upper_bound(sim->symbols.begin(), sim->symbols.end(), address,
+        [](reg_t address, const elf_symbol& symbol) { return address < symbol.address; });
+    if (next == sim->symbols.begin()) return NULL;
+    const elf_symbol& symbol = *(next - 1);
+    if (symbol.size != 0 && address - symbol.address >= symbol.size) return NULL;
+    return &symbol;
+}
+
+// Returns the region holding [address, address + size) entirely, NULL if none does
+static host_region* find_host_region(spikelib_sim_t* sim, reg_t address, reg_t size) {
+    for (host_region& region : sim->regions) {
+        if (address >= region.base && size <= region.size && address - region.base <= region.size - size) {
+            return &region;
+        }
+    }
+    return NULL;
+}
+
+/* Invalidates the decoded instructions of [address, address + size) after
+   the host wrote there. Spike only offers a full flush of its instruction
+   cache, so it is kept for writes to pages that have been fetched as code
+   and skipped for everything else, leaving warm code warm.
+*/
+static void invalidate_code_range(spikelib_sim_t* sim, reg_t address, reg_t size) {
+    if (size == 0) return;
+    for (size_t i = 0; i < sim->harts.size(); i++) {
+        hart_context& hart = sim->harts[i];
+        if (hart.executed_pages.empty()) continue;
+        for (reg_t page = address >> PGSHIFT; page <= (address + size - 1) >> PGSHIFT; page++) {
+            if (hart.executed_pages.count(page) != 0) {
+                flush_hart_code(sim->get_core(i), hart);
+                break;
+            }
+        }
+    }
+}
+
+// Flushes the TLB of every core, needed when the pages the tracers watch change
+static void flush_tlbs(spikelib_sim_t* sim) {
+    for (size_t i = 0; i < sim->nprocs(); i++) {
+        sim->get_core(i)->get_mmu()->flush_tlb();
+    }
+}
+
+// Forgets the decoded code of every hart (breakpoints and executable pages changed)
+static void flush_all_code(spikelib_sim_t* sim) {
+    for (size_t i = 0; i < sim->harts.size(); i++) {
+        flush_hart_code(sim->get_core(i), sim->harts[i]);
+    }
+}
+
+// Programs the PMP of every hart with the entries compiled from the page permission table
+static void program_pmp(spikelib_sim_t* sim, const std::vector<std::pair<reg_t, uint8_t>>& entries) {
+    for (size_t i = 0; i < sim->nprocs(); i++) {
+        state_t* state = sim->get_core(i)->get_state();
+        for (size_t j = 0; j < size_t(state_t::max_pmp); j++) {
+            state->pmpaddr[j] = (j < entries.size()) ? entries[j].first : 0;
+            state->pmpcfg[j]  = (j < entries.size()) ? entries[j].second : 0;
+        }
+    }
+}
+
+// =====================================
+//          SIMULATOR SNAPSHOTS
+// =====================================
+
+// Offset of the pages of a sparse region that were zero in a snapshot
+#define SNAPSHOT_ZERO_PAGE (~size_t(0))
+
+/* Saved contents of a region: a full copy for host-backed regions; for
+   sparse ones only their non-zero pages, so that untouched pages are
+   neither copied nor committed.
+*/
+typedef struct {
+    std::vector<char> data;
+    std::vector<size_t> offsets; // Sparse regions: per page, offset in data or SNAPSHOT_ZERO_PAGE
+} snapshot_region;
+
+// Architectural state and memory contents of a simulator at a given epoch
+typedef struct {
+    spikelib_sim_t* sim;
+    uint32_t epoch;
+    std::vector<state_t> states;
+    std::vector<snapshot_region> contents;
+} sim_snapshot_t;
+
+/* Tells which host pages of a sparse region were committed (in RAM or
+   swapped out) from /proc/self/pagemap, without touching them. Returns
+   false if the pagemap cannot be read.
+*/
+static bool committed_host_pages(const host_region& region, std::vector<bool>* committed) {
+    size_t host_page = sysconf(_SC_PAGESIZE);
+    size_t count = (region.size + host_page - 1) / host_page;
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0) return false;
+    std::vector<uint64_t> entries(count);
+    ssize_t expected = count * sizeof(uint64_t);
+    bool ok = pread(fd, entries.data(), expected, ((uintptr_t) region.content / host_page) * sizeof(uint64_t)) == expected;
+    close(fd);
+    if (!ok) return false;
+    committed->resize(count);
+    for (size_t i = 0; i < count; i++) {
+        // Bit 63: present, bit 62: swapped
+        (*committed)[i] = (entries[i] >> 62) != 0;
+    }
+    return true;
+}
+
+static void save_region(const host_region& region, snapshot_region* saved) {
+    if (!region.sparse) {
+        saved->data.assign(region.content, region.content + region.size);
+        return;
+    }
+    // Uncommitted pages are zero and are not read, which would map them
+    std::vector<bool> committed;
+    bool known = committed_host_pages(region, &committed);
+    size_t host_page = sysconf(_SC_PAGESIZE);
+    static const char zero_page[PGSIZE] = { 0 };
+    for (reg_t offset = 0; offset < region.size; offset += PGSIZE) {
+        reg_t length = std::min(reg_t(PGSIZE), region.size - offset);
+        bool touched = !known;
+        for (size_t page = offset / host_page; known && page <= (offset + length - 1) / host_page; page++) {
+            touched |= committed[page];
+        }
+        if (!touched || memcmp(region.content + offset, zero_page, length) == 0) {
+            saved->offsets.push_back(SNAPSHOT_ZERO_PAGE);
+            continue;
+        }
+        saved->offsets.push_back(saved->data.size());
+        saved->data.insert(saved->data.end(), region.content + offset, region.content + offset + length);
+    }
+}
+
+static void restore_region_page(host_region& region, const snapshot_region& saved, reg_t offset, reg_t length) {
+    if (!region.sparse) {
+        memcpy(region.content + offset, saved.data.data() + offset, length);
+        return;
+    }
+    size_t source = saved.offsets[offset >> PGSHIFT];
+    if (source != SNAPSHOT_ZERO_PAGE) {
+        memcpy(region.content + offset, saved.data.data() + source, length);
+    } else if (madvise(region.content + offset, length, MADV_DONTNEED) != 0) {
+        // Pages smaller than the host's cannot be dropped, zero them instead
+        memset(region.content + offset, 0, length);
+    }
+}
+
 // =====================================
 //   SIMULATION INITIALIZATION HELPERS
 // =====================================
 
+/* Copy of the regions where those given without content are backed by a
+   sparse mapping (map_sparse_content), sparse[i] telling which ones. On
+   failure the mappings made so far are released and false is returned.
+*/
+static bool initialize_sparse_regions(memory_region* memories, int regions_number, std::vector<memory_region>& backed, std::vector<bool>& sparse) {
+    for (int i = 0; i < regions_number; i++) {
+        backed.push_back(memories[i]);
+        sparse.push_back(memories[i].content == NULL);
+        if (memories[i].content == NULL) {
+            backed[i].content = map_sparse_content(memories[i].size);
+            if (backed[i].content == NULL) {
+                for (int j = 0; j < i; j++) {
+                    if (sparse[j]) munmap(backed[j].content, backed[j].size);
+                }
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 std::vector<std::pair<reg_t, mem_t*>> initialize_mems(memory_region* memories, int regions_number) {
     std::vector<std::pair<reg_t, mem_t*>> res;
     // page-align base and size
@@ -30,6 +932,21 @@ std::vector<std::pair<reg_t, mem_t*>> initialize_mems(memory_region* memories, i
     return res;
 }
 
+std::vector<host_region> initialize_host_regions(memory_region* memories, int regions_number, std::vector<std::pair<reg_t, mem_t*>>& mems, std::vector<bool>& sparse) {
+    std::vector<host_region> res;
+    for (int i = 0; i < regions_number; i++) {
+        host_region region = {
+            .base    = reg_t(memories[i].base),
+            .size    = reg_t(memories[i].size),
+            .content = (char*) memories[i].content,
+            .mem     = mems[i].second,
+            .sparse  = sparse[i]
+        };
+        res.push_back(region);
+    }
+    return res;
+}
+
 std::vector<int> initialize_hartids() {
     std::vector<int> hartids;
   //  hartids.push_back(0);  
@@ -64,50 +981,515 @@ void print_byte_array(uint8_t* byte_array, int size) {
 // =====================================
 
 
-static inline int64_t get_clock_realtime(void)
+static inline int64_t get_clock_realtime_us(void)
 {
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000000000LL + (tv.tv_usec * 1000);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// Bounds on the number of instructions run between two clock reads
+#define MIN_CLOCK_CHECK_INTERVAL 64
+#define MAX_CLOCK_CHECK_INTERVAL (1 << 20)
+
+/* Instruction-count clock used to enforce timeouts without reading the time
+   after every batch. The clock is only read once `next_check` instructions
+   have been executed; the interval is then recalibrated from the observed
+   speed so that the next read lands around a quarter of the remaining time.
+*/
+typedef struct {
+    int64_t start_us;
+    uint64_t timeout_us;
+    size_t next_check;
+} timeout_clock;
+
+static inline void timeout_clock_start(timeout_clock* clock, uint64_t timeout_us) {
+    clock->timeout_us = timeout_us;
+    clock->next_check = MIN_CLOCK_CHECK_INTERVAL;
+    clock->start_us   = (timeout_us != 0) ? get_clock_realtime_us() : 0;
+}
+
+static bool timeout_clock_expired(timeout_clock* clock, size_t instruction_count) {
+    if (clock->timeout_us == 0 || instruction_count < clock->next_check) return false;
+    uint64_t elapsed_us = (uint64_t)(get_clock_realtime_us() - clock->start_us);
+    if (elapsed_us >= clock->timeout_us) return true;
+    // Recalibrate on the measured instructions per microsecond
+    uint64_t remaining_us = clock->timeout_us - elapsed_us;
+    double per_us = (double) instruction_count / (double) (elapsed_us ? elapsed_us : 1);
+    double interval = per_us * (double) remaining_us / 4;
+    if (interval < MIN_CLOCK_CHECK_INTERVAL) interval = MIN_CLOCK_CHECK_INTERVAL;
+    if (interval > MAX_CLOCK_CHECK_INTERVAL) interval = MAX_CLOCK_CHECK_INTERVAL;
+    clock->next_check = instruction_count + (size_t) interval;
+    return false;
 }
 
 // =====================================
-//        ERROR CODE FORMATTING
+//         RUN ENGINE HELPERS
 // =====================================
 
-EXPORT const char* sp_strerror(int code) {
-    switch(code) {
-        // _________ OK ________
-        case SP_ERR_OK:
-            return "OK (SP_ERR_OK)";
-        // _____ Execution _____
-        case SP_ERR_TIMEOUT:
-            return "Execution timeout (SP_ERR_TIMEOUT)";
-        case SP_ERR_MAX_COUNT:
-            return "Max number of instructions reached (SP_ERR_MAX_COUNT)";
-        // ________ OOM ________
-        case SP_ERR_NO_MEM:
-            return "No memory available or memory not present (SP_ERR_NO_MEM)";
-        // ______ Unmapped _____
-        case SP_ERR_READ_UNMAPPED:
-            return "Invalid memory read (SP_ERR_READ_UNMAPPED)";
-        case SP_ERR_WRITE_UNMAPPED:
-            return "Invalid memory write (SP_ERR_WRITE_UNMAPPED)";
-        case SP_ERR_FETCH_UNMAPPED:
-            return "Invalid memory fetch (SP_ERR_FETCH_UNMAPPED)";
-        // ______ Invalid ______
-        case SP_ERR_REGID_INVALID:
-            return "Invalid register id (SP_ERR_REGID_INVALID)";
-        case SP_ERR_INSN_INVALID:
-            return "Invalid instruction (SP_ERR_INSN_INVALID)";
-        case SP_ERR_MAP_INVALID:
-            return "Invalid memory mapping (SP_ERR_MAP)";
-        // _____ Protection _____
-        case SP_ERR_READ_PROT:
-            return "Read from non-readable memory (SP_ERR_READ_PROT)";
-        case SP_ERR_WRITE_PROT:
-            return "Write to write-protected memory (SP_ERR_WRITE_PROT)";
-        case SP_ERR_FETCH_PROT:
+// Upper bound on the number of instructions handed to Spike in one step() call
+#define MAX_BATCH_INSTRUCTIONS 256
+
+// Compressed instructions have their two lowest bits different from 0b11
+static inline bool is_compressed(insn_t insn) {
+    return (insn.bits() & 0b11) != 0b11;
+}
+
+// Returns true if the instruction may send the PC somewhere else than the
+// next sequential instruction (branches, jumps, system instructions). This
+// is conservative: anything unsure ends the batch.
+static bool is_control_flow(insn_t insn) {
+    if (is_compressed(insn)) {
+        uint64_t quadrant = insn.bits() & 0b11;
+        uint64_t funct3   = (insn.bits() >> 13) & 0b111;
+        switch (quadrant) {
+            case 0b01: return funct3 == 0b001  // c.jal (RV32) / c.addiw (RV64)
+                           || funct3 == 0b101  // c.j
+                           || funct3 == 0b110  // c.beqz
+                           || funct3 == 0b111; // c.bnez
+            case 0b10: return funct3 == 0b100; // c.jr / c.jalr / c.ebreak
+            default:   return false;
+        }
+    }
+    switch (insn.bits() & 0x7f) {
+        case 0x63: // BRANCH
+        case 0x67: // JALR
+        case 0x6f: // JAL
+        case 0x73: // SYSTEM (ecall, ebreak, xret, wfi, csr)
+        case 0x0f: // MISC-MEM (fence.i)
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Returns true and the target if the instruction is an unconditional jump
+// whose destination is known before executing it (jal, c.j)
+static bool direct_jump_target(insn_t insn, reg_t pc, reg_t* target) {
+    if (is_compressed(insn)) {
+        if ((insn.bits() & 0b11) == 0b01 && ((insn.bits() >> 13) & 0b111) == 0b101) {
+            *target = pc + insn.rvc_j_imm();
+            return true;
+        }
+        return false;
+    }
+    if ((insn.bits() & 0x7f) == 0x6f) {
+        *target = pc + insn.uj_imm();
+        return true;
+    }
+    return false;
+}
+
+// Instruction fence (fence.i): the guest rewrote code, cached blocks are stale
+static inline bool is_fence_i(insn_t insn) {
+    return !is_compressed(insn) && (insn.bits() & 0x707f) == 0x100f;
+}
+
+/* Fetches the instruction at pc through Spike's instruction cache for the
+   library's own decoding, recording the pages it spans as executed so that
+   guest or host writes to them flush the cached copy. Throws on fetch faults.
+*/
+static insn_fetch_t fetch_code(hart_context& hart, processor_t* core, reg_t pc) {
+    insn_fetch_t fetched = core->get_mmu()->load_insn(pc);
+    hart.executed_pages.insert(pc >> PGSHIFT);
+    hart.executed_pages.insert((pc + fetched.insn.length() - 1) >> PGSHIFT);
+    return fetched;
+}
+
+/* Scans the code starting at pc to find how many instructions can be executed
+   in a single core->step() call without stepping over a stop condition. The
+   block ends right before end_address or a breakpoint, after the first branch or indirect
+   jump, or after MAX_BATCH_INSTRUCTIONS. Direct jumps are followed so that
+   tight loops run as one block. A faulting fetch is included so Spike raises
+   the trap itself, such blocks are not cached. Every page the block fetches
+   from is recorded as executed. With keep_insns the instruction bits are
+   kept on the block for translate_block.
+*/
+static cached_block scan_block(hart_context& hart, processor_t* core, reg_t pc, reg_t end_address, const breakpoint_set_t& breakpoints, bool keep_insns) {
+    cached_block block = { .pc = pc, .end_address = end_address, .length = 0, .cacheable = true, .fence_i = false, .hits = 0, .native = NULL, .insns = {} };
+    reg_t last_page = ~reg_t(0);
+    while (block.length < MAX_BATCH_INSTRUCTIONS) {
+        if (block.length > 0 && (pc == end_address || breakpoints.contains(pc))) break;
+        if ((pc >> PGSHIFT) != last_page) {
+            last_page = pc >> PGSHIFT;
+            hart.executed_pages.insert(last_page);
+        }
+        insn_fetch_t fetched;
+        try {
+            fetched = core->get_mmu()->load_insn(pc);
+        } catch (trap_t& t) {
+            block.length++;
+            block.cacheable = false;
+            break;
+        }
+        block.length++;
+        if (keep_insns) {
+            block.insns.push_back((uint32_t) fetched.insn.bits());
+        }
+        // An instruction at the end of a page also fetches from the next one
+        reg_t insn_last_page = (pc + fetched.insn.length() - 1) >> PGSHIFT;
+        if (insn_last_page != last_page) {
+            last_page = insn_last_page;
+            hart.executed_pages.insert(last_page);
+        }
+        reg_t target;
+        if (direct_jump_target(fetched.insn, pc, &target)) {
+            pc = target;
+        } else if (is_control_flow(fetched.insn)) {
+            block.fence_i = is_fence_i(fetched.insn);
+            break;
+        } else {
+            pc += fetched.insn.length();
+        }
+    }
+    return block;
+}
+
+/* Returns the block starting at pc from the hart's block cache, scanning and
+   caching it on a miss. Any prefix of a block is a valid batch, so callers
+   cut it to their remaining budget. The reference stays valid until the
+   next call or the next flush of the hart's code.
+*/
+static inline cached_block& next_block(hart_context& hart, processor_t* core, reg_t pc, reg_t end_address, const breakpoint_set_t& breakpoints, bool keep_insns) {
+    cached_block& entry = hart.blocks[(pc >> 1) % BLOCK_CACHE_ENTRIES];
+    if (entry.pc == pc && entry.end_address == end_address) {
+        return entry;
+    }
+    cached_block block = scan_block(hart, core, pc, end_address, breakpoints, keep_insns);
+    if (block.cacheable) {
+        entry = std::move(block);
+        return entry;
+    }
+    hart.uncached = std::move(block);
+    return hart.uncached;
+}
+
+// Number of full executions after which a block is translated to host code
+#define JIT_HOT_THRESHOLD 16
+
+// The translator covers RV64IM (it emits multiplications and 64-bit operations)
+static inline bool jit_supported(processor_t* core) {
+    return core->get_xlen() == 64 && core->supports_extension('M');
+}
+
+/* Translates a hot block to host code, from the instruction bits scan_block
+   kept along the block's path. Blocks the translator does not cover keep
+   native == NULL and stay on Spike. When the code buffer is full every
+   translation of the hart is dropped and the block is translated again.
+*/
+static void translate_block(hart_context& hart, processor_t* core, cached_block& block) {
+    if (block.insns.size() != block.length) return;
+    uint64_t pcs[MAX_BATCH_INSTRUCTIONS];
+    const uint32_t* insns = block.insns.data();
+    reg_t pc = block.pc;
+    for (size_t i = 0; i < block.length; i++) {
+        insn_t insn(insns[i]);
+        if (is_compressed(insn)) return;
+        pcs[i] = pc;
+        reg_t target;
+        pc = direct_jump_target(insn, pc, &target) ? target : pc + 4;
+    }
+
+    if (!hart.jit) {
+        hart.jit.reset(new jit_t());
+    }
+    bool compressed_ok = core->supports_extension('C');
+    jit_block_fn native = hart.jit->translate(pcs, insns, block.length, compressed_ok);
+    if (native == NULL && hart.jit->full()) {
+        hart.jit->reset();
+        for (cached_block& entry : hart.blocks) {
+            entry.native = NULL;
+            entry.hits = 0;
+        }
+        native = hart.jit->translate(pcs, insns, block.length, compressed_ok);
+    }
+    block.native = native;
+    if (native != NULL) {
+        hart.jit_translations++;
+    }
+}
+
+/* Runs a whole translated block, which has the architectural effect of
+   core->step(block.length): integer registers, pc and minstret. Translated
+   blocks cannot trap. In differential mode the translation runs on a copy of
+   the registers, Spike then runs the block and stays authoritative, and any
+   divergence is counted in jit_mismatches.
+*/
+static void run_native_block(spikelib_sim_t* sim, hart_context& hart, processor_t* core, cached_block& block) {
+    state_t* state = core->get_state();
+    uint64_t* xpr = const_cast<uint64_t*>(&state->XPR[0]);
+    if (sim->jit_mode == SPIKE_JIT_DIFFERENTIAL) {
+        uint64_t native_xpr[NXPR];
+        memcpy(native_xpr, xpr, sizeof(native_xpr));
+        reg_t native_pc = block.native(native_xpr);
+        core->step(block.length);
+        if (native_pc != state->pc || memcmp(native_xpr, xpr, sizeof(native_xpr)) != 0) {
+            hart.jit_mismatches++;
+        }
+    } else {
+        state->pc = block.native(xpr);
+        state->minstret += block.length;
+    }
+    hart.jit_native_runs++;
+}
+
+/* Translates the cause of a trap taken by the core to an error code. Traps
+   that are not memory or instruction errors (breakpoints, environment calls,
+   interrupts) do not stop the simulation and map to SP_ERR_OK.
+*/
+static sp_err trap_cause_to_error(reg_t cause) {
+    switch(cause) {
+        // P. 102-105
+        case CAUSE_MISALIGNED_FETCH: return SP_ERR_FETCH_MISALIGNED; // mcause = 0 | Instruction address misaligned
+        case CAUSE_FETCH_ACCESS:     return SP_ERR_FETCH_UNMAPPED;   // mcause = 1 | Instruction access fault
+        case CAUSE_ILLEGAL_INSTRUCTION: return SP_ERR_INSN_INVALID;  // mcause = 2 | Illegal instruction
+        case CAUSE_MISALIGNED_LOAD:  return SP_ERR_READ_MISALIGNED;  // mcause = 4 | Load address misaligned
+        case CAUSE_LOAD_ACCESS:      return SP_ERR_READ_UNMAPPED;    // mcause = 5 | Load access fault
+        case CAUSE_MISALIGNED_STORE: return SP_ERR_WRITE_MISALIGNED; // mcause = 6 | Store address misaligned
+        case CAUSE_STORE_ACCESS:     return SP_ERR_WRITE_UNMAPPED;   // mcause = 7 | Store access fault
+        default:                     return SP_ERR_OK;
+    }
+}
+
+/* Trap event raised by the run engine when the core takes an exception.
+   Spike ends a step() batch as soon as it traps, so only a batch that
+   retires fewer instructions than requested can hold one. The guest may
+   write minstret, so the trap is confirmed by the trap CSRs of machine or
+   supervisor mode (delegated traps): the cause or epc changed during the
+   batch, or the pc is on the handler of the current cause (a trap repeated
+   with the same CSRs). The cause is only decoded at that point, so stale
+   values left over from a previous run can no longer be mistaken for a
+   new exception.
+*/
+typedef struct {
+    bool taken;
+    sp_err error;
+    bool supervisor;  // Taken in supervisor mode (delegated), the s* CSRs hold it
+    reg_t cause;
+    reg_t address;    // mtval or stval
+} trap_event;
+
+// Trap state before a batch, against which check_trap_event compares and that undo_watch_trap restores
+typedef struct {
+    reg_t mcause, mepc, scause, sepc;
+    reg_t mtval, stval, mstatus, prv;
+} trap_csrs;
+
+static inline trap_csrs save_trap_csrs(state_t* state) {
+    trap_csrs saved = { .mcause = state->mcause, .mepc = state->mepc, .scause = state->scause, .sepc = state->sepc,
+                        .mtval = state->mtval, .stval = state->stval, .mstatus = state->mstatus, .prv = state->prv };
+    return saved;
+}
+
+/* Undoes the breakpoint trap raised by the watch tracer: the trap CSRs,
+   mstatus (MPP, MPIE, MIE and their supervisor counterparts) and the
+   privilege go back to their values before the batch, and the pc to the
+   accessing instruction.
+*/
+static void undo_watch_trap(state_t* state, const trap_csrs& before, const trap_event& trap) {
+    state->pc      = trap.supervisor ? state->sepc : state->mepc;
+    state->mcause  = before.mcause;
+    state->mepc    = before.mepc;
+    state->mtval   = before.mtval;
+    state->scause  = before.scause;
+    state->sepc    = before.sepc;
+    state->stval   = before.stval;
+    state->mstatus = before.mstatus;
+    state->prv     = before.prv;
+}
+
+// Handler address of a trap: the base of tvec, offset by 4 * cause for interrupts in vectored mode
+static inline reg_t trap_vector(reg_t tvec, reg_t cause) {
+    const reg_t interrupt = reg_t(1) << (sizeof(reg_t) * 8 - 1);
+    reg_t base = tvec & ~reg_t(3);
+    return ((tvec & 3) == 1 && (cause & interrupt)) ? base + 4 * (cause & ~interrupt) : base;
+}
+
+static inline trap_event check_trap_event(memory_map_t& memory, state_t* state, const trap_csrs& before, size_t batch, size_t retired) {
+    trap_event event = { .taken = false, .error = SP_ERR_OK, .supervisor = false, .cause = 0, .address = 0 };
+    if (retired >= batch) return event;
+    bool machine = state->mcause != before.mcause || state->mepc != before.mepc
+        || state->pc == trap_vector(state->mtvec, state->mcause);
+    bool supervisor = state->scause != before.scause || state->sepc != before.sepc
+        || state->pc == trap_vector(state->stvec, state->scause);
+    if (!machine && !supervisor) return event;
+    event.taken      = true;
+    event.supervisor = !machine;
+    event.cause      = machine ? state->mcause : state->scause;
+    event.address    = machine ? state->mtval : state->stval;
+    // Access faults on mapped pages are protection violations
+    event.error = memory.access_error(trap_cause_to_error(event.cause), event.address);
+    return event;
+}
+
+// Destination register field, which moves around in compressed encodings
+static unsigned trace_rd(insn_t insn) {
+    if (!is_compressed(insn)) return insn.rd();
+    switch (insn.bits() & 0b11) {
+        case 0b00: return insn.rvc_rs2s();                                      // CIW, CL
+        case 0b01: return ((insn.bits() >> 13) & 0b111) >= 4 ? insn.rvc_rs1s() : insn.rd(); // CB, CA
+        default:   return insn.rd();                                            // CI, CR
+    }
+}
+
+/* Fills the parts of a trace record known before the instruction runs: pc,
+   bits, destination register and the effective address of loads, stores
+   and atomics (rs1 may be overwritten by the instruction itself).
+*/
+static void trace_before(hart_context& hart, processor_t* core, spike_trace_record* record) {
+    state_t* state = core->get_state();
+    memset(record, 0, sizeof(*record));
+    record->pc = state->pc;
+    insn_fetch_t fetched;
+    try {
+        fetched = fetch_code(hart, core, state->pc);
+    } catch (trap_t& t) {
+        return;
+    }
+    insn_t insn = fetched.insn;
+    record->bits = is_compressed(insn) ? insn.bits() & 0xffff : insn.bits();
+    record->rd   = trace_rd(insn);
+
+    bool memory = true;
+    reg_t address = 0;
+    if (!is_compressed(insn)) {
+        switch (insn.bits() & 0x7f) {
+            case 0x03: case 0x07: address = state->XPR[insn.rs1()] + insn.i_imm(); break; // Loads
+            case 0x23: case 0x27: address = state->XPR[insn.rs1()] + insn.s_imm(); break; // Stores
+            case 0x2f:            address = state->XPR[insn.rs1()]; break;                // Atomics
+            default:              memory = false;
+        }
+    } else {
+        unsigned funct3 = (insn.bits() >> 13) & 0b111;
+        bool doubleword = funct3 == 1 || funct3 == 5 || ((funct3 == 3 || funct3 == 7) && core->get_xlen() == 64);
+        if (funct3 == 0 || funct3 == 4 || (insn.bits() & 0b11) == 0b01) {
+            memory = false;
+        } else if ((insn.bits() & 0b11) == 0b00) {
+            address = state->XPR[insn.rvc_rs1s()] + (doubleword ? insn.rvc_ld_imm() : insn.rvc_lw_imm());
+        } else if (funct3 < 4) {
+            address = state->XPR[2] + (doubleword ? insn.rvc_ldsp_imm() : insn.rvc_lwsp_imm());
+        } else {
+            address = state->XPR[2] + (doubleword ? insn.rvc_sdsp_imm() : insn.rvc_swsp_imm());
+        }
+    }
+    if (memory) {
+        record->mem_address = address;
+        record->flags |= SPIKE_TRACE_MEM;
+    }
+}
+
+// Completes a trace record once the instruction ran or trapped
+static inline void trace_after(processor_t* core, spike_trace_record* record, bool trapped) {
+    record->rd_value = core->get_state()->XPR[record->rd];
+    if (trapped) {
+        record->flags |= SPIKE_TRACE_TRAP;
+    }
+}
+
+// Leaves the trap handler: back to the trapping instruction, interrupts enabled again
+static void return_from_trap(processor_t* core, const trap_event& trap) {
+    state_t* state = core->get_state();
+    state->pc = trap.supervisor ? state->sepc : state->mepc;
+    reg_t s = state->mstatus;
+    s = set_field(s, trap.supervisor ? MSTATUS_SIE : MSTATUS_MIE, 1);
+    core->set_csr(CSR_MSTATUS, s);
+}
+
+/* Calls the code hooks covering the instruction at pc, before it runs. The
+   size comes from an instruction fetch rather than a data load, which the
+   memory hooks and watchpoints would see.
+*/
+static void run_code_hooks(spikelib_sim_t* sim, hart_context& hart, processor_t* core, reg_t pc) {
+    uint32_t size = 0;
+    try {
+        size = fetch_code(hart, core, pc).insn.length();
+    } catch (trap_t& t) {
+        // Spike raises the fetch fault when running the instruction
+    }
+    void* handle = static_cast<void*>((sim_t*) sim);
+    for (size_t i = 0; i < sim->hooks.size(); i++) {
+        hook installed = sim->hooks[i];
+        if ((installed.type & SPIKE_HOOK_CODE) && hook_covers(installed, pc, pc)) {
+            ((spike_hook_code_cb) installed.callback)(handle, pc, size, installed.user_data);
+        }
+    }
+}
+
+static inline bool is_invalid_memory_error(sp_err error) {
+    switch (error) {
+        case SP_ERR_READ_UNMAPPED: case SP_ERR_WRITE_UNMAPPED: case SP_ERR_FETCH_UNMAPPED:
+        case SP_ERR_READ_PROT:     case SP_ERR_WRITE_PROT:     case SP_ERR_FETCH_PROT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Calls the interrupt hooks for a trap taken by the guest and, for unmapped
+   or protected accesses, the invalid memory hooks covering the faulting
+   address (mtval). Returns true if an invalid memory hook asked to retry
+   the access.
+*/
+static bool run_trap_hooks(spikelib_sim_t* sim, trap_event trap) {
+    bool retry = false;
+    bool invalid = is_invalid_memory_error(trap.error);
+    // The breakpoint trap of a watchpoint is raised by the library, not the guest
+    bool guest_trap = trap.error != SP_ERR_WATCHPOINT;
+    reg_t cause = trap.cause;
+    reg_t address = trap.address;
+    void* handle = static_cast<void*>((sim_t*) sim);
+    for (size_t i = 0; i < sim->hooks.size(); i++) {
+        hook installed = sim->hooks[i];
+        if (installed.type & SPIKE_HOOK_INTR) {
+            if (guest_trap) {
+                ((spike_hook_intr_cb) installed.callback)(handle, cause, installed.user_data);
+            }
+        } else if ((installed.type & SPIKE_HOOK_MEM_INVALID) && invalid && hook_covers(installed, address, address)) {
+            if (((spike_hook_mem_invalid_cb) installed.callback)(handle, trap.error, address, installed.user_data)) {
+                retry = true;
+            }
+        }
+    }
+    return retry;
+}
+
+// =====================================
+//        ERROR CODE FORMATTING
+// =====================================
+
+EXPORT const char* sp_strerror(int code) {
+    switch(code) {
+        // _________ OK ________
+        case SP_ERR_OK:
+            return "OK (SP_ERR_OK)";
+        // _____ Execution _____
+        case SP_ERR_TIMEOUT:
+            return "Execution timeout (SP_ERR_TIMEOUT)";
+        case SP_ERR_MAX_COUNT:
+            return "Max number of instructions reached (SP_ERR_MAX_COUNT)";
+        // ________ OOM ________
+        case SP_ERR_NO_MEM:
+            return "No memory available or memory not present (SP_ERR_NO_MEM)";
+        // ______ Unmapped _____
+        case SP_ERR_READ_UNMAPPED:
+            return "Invalid memory read (SP_ERR_READ_UNMAPPED)";
+        case SP_ERR_WRITE_UNMAPPED:
+            return "Invalid memory write (SP_ERR_WRITE_UNMAPPED)";
+        case SP_ERR_FETCH_UNMAPPED:
+            return "Invalid memory fetch (SP_ERR_FETCH_UNMAPPED)";
+        // ______ Invalid ______
+        case SP_ERR_REGID_INVALID:
+            return "Invalid register id (SP_ERR_REGID_INVALID)";
+        case SP_ERR_INSN_INVALID:
+            return "Invalid instruction (SP_ERR_INSN_INVALID)";
+        case SP_ERR_MAP_INVALID:
+            return "Invalid memory mapping (SP_ERR_MAP)";
+        // _____ Protection _____
+        case SP_ERR_READ_PROT:
+            return "Read from non-readable memory (SP_ERR_READ_PROT)";
+        case SP_ERR_WRITE_PROT:
+            return "Write to write-protected memory (SP_ERR_WRITE_PROT)";
+        case SP_ERR_FETCH_PROT:
             return "Fetch from non-executable memory (SP_ERR_FETCH_PROT)";
         // _____ Alignment ______
         case SP_ERR_READ_MISALIGNED:
@@ -118,6 +1500,18 @@ EXPORT const char* sp_strerror(int code) {
             return "Fetch from unaligned memory (SP_ERR_FETCH_MISALIGNED)";
         case SP_ERR_INVALID_SIMULATOR:
             return "Simulator invalid (uninitialized) (SP_ERR_INVALID_SIMULATOR)";
+        case SP_ERR_HARTID_INVALID:
+            return "Invalid hart id (SP_ERR_HARTID_INVALID)";
+        // ______ Debugging _____
+        case SP_ERR_WATCHPOINT:
+            return "Watched memory accessed (SP_ERR_WATCHPOINT)";
+        case SP_ERR_BREAKPOINT:
+            return "Breakpoint reached (SP_ERR_BREAKPOINT)";
+        case SP_ERR_STOPPED:
+            return "Run stopped by spike_stop (SP_ERR_STOPPED)";
+        // ________ ELF _________
+        case SP_ERR_ELF_INVALID:
+            return "Invalid or unsupported ELF file (SP_ERR_ELF_INVALID)";
         // ______ Unknown _______
         default:
             return "Unknown error code";
@@ -128,13 +1522,29 @@ EXPORT const char* sp_strerror(int code) {
 //         PHARO API WRAPPERS
 // =====================================
 
+// Serializes the construction of simulators, the only non thread-safe part
+// of Spike reached by the library (see initialize_sim_with_harts). Softfloat's
+// rounding mode and exception flags are the other process globals, the build
+// makes them thread-local (THREAD_LOCAL in CMakeLists.txt).
+static std::mutex sim_construction_lock;
 
-EXPORT void* initialize_sim_with_isa(memory_region* memories, int regions_number, const char* isa){
-    size_t nprocs              = size_t(1);      // Number of processors                         
+
+EXPORT void* initialize_sim_with_harts(memory_region* memories, int regions_number, const char* isa, int harts_number){
+    if (harts_number <= 0) {
+        return NULL;
+    }
+    size_t nprocs              = size_t(harts_number); // Number of processors (hartids 0 to nprocs - 1)
     bool halted                = false;          // Start halted, allowing a debugger to connect    
     reg_t start_pc             = reg_t(0x1000);  // Start PC
+    std::vector<memory_region> backed;           // Regions, sparse ones backed by the library
+    std::vector<bool> sparse;                    // -
+    if (!initialize_sparse_regions(memories, regions_number, backed, sparse)) {
+        return NULL;
+    }
     std::vector<std::pair<reg_t, mem_t*>> mems;  // Memories
-    mems = initialize_mems(memories, regions_number); // -
+    mems = initialize_mems(backed.data(), regions_number); // -
+    std::vector<host_region> regions;            // Host view of the memories
+    regions = initialize_host_regions(backed.data(), regions_number, mems, sparse); // -
     std::vector<std::string> htif_args;          // Arguments for htif
     std::string str("toto");                     // -
     htif_args.push_back(str);                    // -
@@ -145,10 +1555,13 @@ EXPORT void* initialize_sim_with_isa(memory_region* memories, int regions_number
     bool require_authentication = false;         // Debug module requires debugger to authenticate
     unsigned abstract_rti = 0;                   // Number of Run-Test/Idle cycles
 
-    void* sim;
+    sim_t* sim;
 
+    // Spike parses the HTIF arguments with getopt, which is not reentrant
+    std::lock_guard<std::mutex> guard(sim_construction_lock);
     try{
-        sim = new sim_t(
+        sim = new spikelib_sim_t(
+        regions,
         isa, 
         nprocs, 
         halted, 
@@ -163,34 +1576,202 @@ EXPORT void* initialize_sim_with_isa(memory_region* memories, int regions_number
     );
 
     } catch(...){
+        for (host_region& region : regions) {
+            if (region.sparse) munmap(region.content, region.size);
+        }
         return NULL;
     }
 
     return static_cast<void*>(sim);
 }
 
+EXPORT void* initialize_sim_with_isa(memory_region* memories, int regions_number, const char* isa) {
+    return initialize_sim_with_harts(memories, regions_number, isa, 1);
+}
+
 EXPORT void* initialize_sim(memory_region* memories, int regions_number) {
     // DEFAULT_ISA: (rv32 or rv64 with extensions, g = imafd)  DEFAULT = IMAFDC
     return initialize_sim_with_isa(memories, regions_number, DEFAULT_ISA);
 }
 
 EXPORT void release_sim(void* sim) {
-    delete((sim_t*) sim);
+    delete(get_spikelib_sim(sim));
+}
+
+// =====================================
+//           SIMULATOR POOL
+// =====================================
+
+// Maximum number of idle simulators kept across all pool keys
+#define MAX_POOLED_SIMULATORS 64
+
+static std::mutex sim_pool_lock;
+static std::unordered_map<std::string, std::vector<spikelib_sim_t*>> sim_pool;
+static size_t sim_pool_size   = 0;
+static uint64_t sim_pool_hits   = 0;
+static uint64_t sim_pool_misses = 0;
+
+// Pool key: the ISA string followed by the base and size of every region
+static std::string sim_pool_key(memory_region* memories, int regions_number, const char* isa) {
+    std::string key(isa);
+    char buffer[64];
+    for (int i = 0; i < regions_number; i++) {
+        snprintf(buffer, sizeof(buffer), ":%lx+%lx", memories[i].base, memories[i].size);
+        key += buffer;
+    }
+    return key;
+}
+
+/* Bring a recycled simulator back to a clean architectural state and bind
+   its memory regions to new host buffers. The mem_t objects seen by Spike's
+   bus are rebuilt in place so the bus keeps pointing to them. Sparse regions
+   staying sparse keep their mapping, emptied. Returns false if a sparse
+   region cannot be mapped.
+*/
+static bool reset_pooled_sim(spikelib_sim_t* sim, memory_region* memories) {
+    for (size_t i = 0; i < sim->regions.size(); i++) {
+        host_region& region = sim->regions[i];
+        if (memories[i].content == NULL && region.sparse) {
+            // Drop the committed pages, they read as zero again
+            madvise(region.content, region.size, MADV_DONTNEED);
+            continue;
+        }
+        if (region.sparse) {
+            munmap(region.content, region.size);
+        }
+        region.sparse  = memories[i].content == NULL;
+        region.content = region.sparse ? map_sparse_content(region.size) : (char*) memories[i].content;
+        if (region.content == NULL) {
+            region.sparse = false;
+            return false;
+        }
+        region.mem->~mem_t();
+        new (region.mem) mem_t(region.size, region.content);
+    }
+    for (size_t i = 0; i < sim->nprocs(); i++) {
+        processor_t* core = sim->get_core(i);
+        core->reset();
+        core->get_mmu()->flush_tlb();
+        flush_hart_code(core, sim->harts[i]);
+        sim->harts[i].jit_translations = 0;
+        sim->harts[i].jit_native_runs = 0;
+        sim->harts[i].jit_mismatches = 0;
+        sim->harts[i].run_end_address = ~reg_t(0);
+        sim->harts[i].run_instructions = 0;
+        sim->harts[i].run_time_us = 0;
+        sim->harts[i].hit_breakpoint = 0;
+    }
+    // recycle_sim joined the asynchronous run, leaving its stop request behind
+    sim->async_started = false;
+    sim->stop_requested.store(false);
+    sim->writes = write_tracker_t(&sim->regions);
+    // The core reset cleared the PMP entries along with the rest of the state
+    sim->memory = memory_map_t(&sim->regions);
+    sim->jit_mode = SPIKE_JIT_OFF;
+    sim->profiling = false;
+    sim->watches.ranges.clear();
+    sim->watches.pages.clear();
+    sim->breakpoints.clear();
+    sim->hooks.clear();
+    sim->hook_types = 0;
+    sim->symbols.clear();
+    sim->symbols_by_name.clear();
+    for (hart_context& hart : sim->harts) {
+        hart.profile.clear();
+        hart.tracer.reset();
+        hart.watcher.pending = false;
+        hart.watcher.hit_address = 0;
+        hart.watcher.hit_kind = 0;
+        hart.watcher.step_over = false;
+    }
+    return true;
+}
+
+/* Get a simulator for the given memory regions and ISA, recycled from the
+   pool when one with the same ISA and layout is idle, created otherwise.
+   Give it back with recycle_sim (or free it with release_sim).
+*/
+EXPORT void* acquire_sim(memory_region* memories, int regions_number, const char* isa) {
+    std::string key = sim_pool_key(memories, regions_number, isa);
+    spikelib_sim_t* sim = NULL;
+    {
+        std::lock_guard<std::mutex> guard(sim_pool_lock);
+        auto idle = sim_pool.find(key);
+        if (idle != sim_pool.end() && !idle->second.empty()) {
+            sim = idle->second.back();
+            idle->second.pop_back();
+            sim_pool_size--;
+            sim_pool_hits++;
+        } else {
+            sim_pool_misses++;
+        }
+    }
+    if (sim != NULL) {
+        if (!reset_pooled_sim(sim, memories)) {
+            delete sim;
+            return NULL;
+        }
+        return static_cast<void*>((sim_t*) sim);
+    }
+    void* created = initialize_sim_with_isa(memories, regions_number, isa);
+    if (created != NULL) {
+        get_spikelib_sim(created)->pool_key = key;
+    }
+    return created;
+}
+
+// Give a simulator obtained from acquire_sim back to the pool
+EXPORT void recycle_sim(void* sim) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) return;
+    real_sim->stop_async_run();
+    {
+        std::lock_guard<std::mutex> guard(sim_pool_lock);
+        if (!real_sim->pool_key.empty() && sim_pool_size < MAX_POOLED_SIMULATORS) {
+            sim_pool[real_sim->pool_key].push_back(real_sim);
+            sim_pool_size++;
+            return;
+        }
+    }
+    release_sim(sim);
+}
+
+// Number of acquire_sim calls served from the pool (hits) or by a new simulator (misses)
+EXPORT void sim_pool_stats(uint64_t* hits, uint64_t* misses) {
+    std::lock_guard<std::mutex> guard(sim_pool_lock);
+    *hits   = sim_pool_hits;
+    *misses = sim_pool_misses;
+}
+
+// Free every idle simulator of the pool
+EXPORT void drain_sim_pool() {
+    std::lock_guard<std::mutex> guard(sim_pool_lock);
+    for (auto& idle : sim_pool) {
+        for (spikelib_sim_t* sim : idle.second) {
+            delete sim;
+        }
+    }
+    sim_pool.clear();
+    sim_pool_size = 0;
 }
 
 
 /* Read a value from a register into a buffer
    Arguments: sim (void *) - Pointer to the simulation 
 */
-EXPORT int read_register(void* sim, int regid, void* value) {
+EXPORT int read_register_hart(void* sim, int hartid, int regid, void* value) {
     sim_t* real_sim = (sim_t*) sim;
     if (real_sim == NULL) {
         return SP_ERR_INVALID_SIMULATOR;
     }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    processor_t* core = real_sim->get_core(hartid);
     switch(regid) {
         // PC
         case SPIKE_RISCV_REG_PC: {
-            *((uint64_t*) value) = real_sim->get_core(0)->get_state()->pc;
+            *((uint64_t*) value) = core->get_state()->pc;
             break;
         }
         // General Registers
@@ -226,7 +1807,7 @@ EXPORT int read_register(void* sim, int regid, void* value) {
         case SPIKE_RISCV_REG_X29:
         case SPIKE_RISCV_REG_X30:
         case SPIKE_RISCV_REG_X31: {
-            *((uint64_t*) value) = real_sim->get_core(0)->get_state()->XPR[regid-SPIKE_RISCV_REG_X0];
+            *((uint64_t*) value) = core->get_state()->XPR[regid-SPIKE_RISCV_REG_X0];
             break;
         }
         // Floating Point Registers
@@ -262,7 +1843,7 @@ EXPORT int read_register(void* sim, int regid, void* value) {
         case SPIKE_RISCV_REG_F29:
         case SPIKE_RISCV_REG_F30:
         case SPIKE_RISCV_REG_F31: {
-            *((float128_t*) value) = real_sim->get_core(0)->get_state()->FPR[regid-SPIKE_RISCV_REG_F0];
+            *((float128_t*) value) = core->get_state()->FPR[regid-SPIKE_RISCV_REG_F0];
             break;
         }
         // Unknown Regid
@@ -271,15 +1852,23 @@ EXPORT int read_register(void* sim, int regid, void* value) {
     return SP_ERR_OK;
 }
 
-EXPORT int write_register(void* sim, int regid, void* value) {  
+EXPORT int read_register(void* sim, int regid, void* value) {
+    return read_register_hart(sim, 0, regid, value);
+}
+
+EXPORT int write_register_hart(void* sim, int hartid, int regid, void* value) {
     sim_t* real_sim = (sim_t*) sim;
     if (real_sim == NULL) {
         return SP_ERR_INVALID_SIMULATOR;
     }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    processor_t* core = real_sim->get_core(hartid);
     switch(regid) {
         // PC
         case SPIKE_RISCV_REG_PC: {
-            real_sim->get_core(0)->get_state()->pc = (*((uint64_t*)value));
+            core->get_state()->pc = (*((uint64_t*)value));
             break;
         }
         // General Registers
@@ -315,7 +1904,7 @@ EXPORT int write_register(void* sim, int regid, void* value) {
         case SPIKE_RISCV_REG_X29:
         case SPIKE_RISCV_REG_X30:
         case SPIKE_RISCV_REG_X31: {
-            real_sim->get_core(0)->get_state()->XPR.write(regid-SPIKE_RISCV_REG_X0, *((uint64_t*)value));
+            core->get_state()->XPR.write(regid-SPIKE_RISCV_REG_X0, *((uint64_t*)value));
             break;
         }   
         // Floating Point Registers
@@ -351,7 +1940,7 @@ EXPORT int write_register(void* sim, int regid, void* value) {
         case SPIKE_RISCV_REG_F29:
         case SPIKE_RISCV_REG_F30:
         case SPIKE_RISCV_REG_F31: {
-            real_sim->get_core(0)->get_state()->FPR.write(regid-SPIKE_RISCV_REG_F0, *((float128_t *)value));
+            core->get_state()->FPR.write(regid-SPIKE_RISCV_REG_F0, *((float128_t *)value));
             break;
         }   
         // Unknown regid
@@ -360,6 +1949,145 @@ EXPORT int write_register(void* sim, int regid, void* value) {
     return SP_ERR_OK;
 }
 
+EXPORT int write_register(void* sim, int regid, void* value) {
+    return write_register_hart(sim, 0, regid, value);
+}
+
+/* Read the register banks selected in a spike_register_file in one call
+   Arguments: registers (spike_register_file*) - version and banks set by the caller
+*/
+EXPORT int read_registers_hart(void* sim, int hartid, void* registers) {
+    sim_t* real_sim = (sim_t*) sim;
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    processor_t* core = real_sim->get_core(hartid);
+    spike_register_file* file = (spike_register_file*) registers;
+    if (file->version != SPIKE_REGISTER_FILE_VERSION || (file->banks & ~SPIKE_REGS_ALL) != 0) {
+        return SP_ERR_REGID_INVALID;
+    }
+    state_t* state = core->get_state();
+    if (file->banks & SPIKE_REGS_XPR) {
+        for (int i = 0; i < 32; i++) {
+            file->xpr[i] = state->XPR[i];
+        }
+    }
+    if (file->banks & SPIKE_REGS_PC) {
+        file->pc = state->pc;
+    }
+    if (file->banks & SPIKE_REGS_FPR) {
+        for (int i = 0; i < 32; i++) {
+            memcpy(file->fpr[i], &state->FPR[i], sizeof(file->fpr[i]));
+        }
+    }
+    return SP_ERR_OK;
+}
+
+EXPORT int read_registers(void* sim, void* registers) {
+    return read_registers_hart(sim, 0, registers);
+}
+
+EXPORT int write_registers_hart(void* sim, int hartid, void* registers) {
+    sim_t* real_sim = (sim_t*) sim;
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    processor_t* core = real_sim->get_core(hartid);
+    spike_register_file* file = (spike_register_file*) registers;
+    if (file->version != SPIKE_REGISTER_FILE_VERSION || (file->banks & ~SPIKE_REGS_ALL) != 0) {
+        return SP_ERR_REGID_INVALID;
+    }
+    state_t* state = core->get_state();
+    if (file->banks & SPIKE_REGS_XPR) {
+        for (int i = 0; i < 32; i++) {
+            state->XPR.write(i, file->xpr[i]);
+        }
+    }
+    if (file->banks & SPIKE_REGS_PC) {
+        state->pc = file->pc;
+    }
+    if (file->banks & SPIKE_REGS_FPR) {
+        for (int i = 0; i < 32; i++) {
+            float128_t value;
+            memcpy(&value, file->fpr[i], sizeof(value));
+            state->FPR.write(i, value);
+        }
+    }
+    return SP_ERR_OK;
+}
+
+EXPORT int write_registers(void* sim, void* registers) {
+    return write_registers_hart(sim, 0, registers);
+}
+
+/* Capture the hart state and the memory regions of a simulator
+   Returns: an opaque snapshot to give to sim_restore, NULL on failure.
+   Snapshots must be released with release_snapshot before their simulator.
+*/
+EXPORT void* sim_snapshot(void* sim) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return NULL;
+    }
+    sim_snapshot_t* snapshot = new sim_snapshot_t();
+    snapshot->sim   = real_sim;
+    for (size_t i = 0; i < real_sim->nprocs(); i++) {
+        snapshot->states.push_back(*real_sim->get_core(i)->get_state());
+    }
+    snapshot->contents.resize(real_sim->regions.size());
+    for (size_t i = 0; i < real_sim->regions.size(); i++) {
+        save_region(real_sim->regions[i], &snapshot->contents[i]);
+    }
+    // Writes from now on belong to a new epoch, re-arm the tracked pages
+    real_sim->writes.enabled = true;
+    snapshot->epoch = ++real_sim->writes.epoch;
+    flush_tlbs(real_sim);
+    return static_cast<void*>(snapshot);
+}
+
+/* Bring a simulator back to a snapshot taken on it. Only the pages written
+   (by the guest or the host) since the snapshot are copied back, and they
+   count as written at the restore for the snapshots taken before it.
+*/
+EXPORT int sim_restore(void* sim, void* snapshot) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    sim_snapshot_t* real_snapshot = (sim_snapshot_t*) snapshot;
+    if (real_sim == NULL || real_snapshot == NULL || real_snapshot->sim != real_sim) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    write_tracker_t& writes = real_sim->writes;
+    // Stores after the restore must be recorded again
+    uint32_t restore_epoch = ++writes.epoch;
+    for (size_t i = 0; i < real_sim->regions.size(); i++) {
+        host_region& region = real_sim->regions[i];
+        for (reg_t page = 0; page < writes.stamps[i].size(); page++) {
+            if (writes.stamps[i][page] < real_snapshot->epoch) continue;
+            reg_t offset = page << PGSHIFT;
+            reg_t length = std::min(reg_t(PGSIZE), region.size - offset);
+            restore_region_page(region, real_snapshot->contents[i], offset, length);
+            writes.stamps[i][page] = restore_epoch;
+            invalidate_code_range(real_sim, region.base + offset, length);
+        }
+    }
+    for (size_t i = 0; i < real_sim->nprocs(); i++) {
+        *real_sim->get_core(i)->get_state() = real_snapshot->states[i];
+    }
+    // The memory map is not part of snapshots, keep enforcing the current one
+    program_pmp(real_sim, real_sim->memory.pmp_entries());
+    flush_tlbs(real_sim);
+    return SP_ERR_OK;
+}
+
+EXPORT void release_snapshot(void* snapshot) {
+    delete((sim_snapshot_t*) snapshot);
+}
+
 EXPORT int read_memory(void* sim, uint64_t address, uint64_t size, void* value) {
     sim_t* real_sim = (sim_t*) sim;
     if (real_sim == NULL) {
@@ -367,7 +2095,15 @@ EXPORT int read_memory(void* sim, uint64_t address, uint64_t size, void* value)
     }
     // Check alignment
     if ((int) address % 8 != 0) return SP_ERR_READ_MISALIGNED;
-    // Switch on the size to call the proper function
+    // Fast path: copy straight from the host buffer backing the region
+    host_region* region = find_host_region(get_spikelib_sim(sim), address, size);
+    if (region != NULL) {
+        // The host ignores protections, not unmapped pages
+        if (!get_spikelib_sim(sim)->memory.mapped(address, size)) return SP_ERR_READ_UNMAPPED;
+        memcpy(value, region->content + (address - region->base), size);
+        return SP_ERR_OK;
+    }
+    // Slow path (MMIO or unmapped): switch on the size to call the proper function
     switch(size) {
         case 1:
             *((uint8_t*) value) = real_sim->get_core(0)->get_mmu()->load_uint8(address);
@@ -397,7 +2133,16 @@ EXPORT int write_memory(void* sim, uint64_t address, uint64_t size, void* value)
     }
     // Check alignment
     if ((int) address % 8 != 0) return SP_ERR_WRITE_MISALIGNED;
-    // Switch on the size to call the proper function
+    // Fast path: copy straight to the host buffer backing the region
+    host_region* region = find_host_region(get_spikelib_sim(sim), address, size);
+    if (region != NULL) {
+        if (!get_spikelib_sim(sim)->memory.mapped(address, size)) return SP_ERR_WRITE_UNMAPPED;
+        memcpy(region->content + (address - region->base), value, size);
+        get_spikelib_sim(sim)->writes.stamp(address, size);
+        invalidate_code_range(get_spikelib_sim(sim), address, size);
+        return SP_ERR_OK;
+    }
+    // Slow path (MMIO or unmapped): switch on the size to call the proper function
     switch(size) {
         case 1:
             real_sim->get_core(0)->get_mmu()->store_uint8(address, *((uint8_t*) value));
@@ -417,7 +2162,10 @@ EXPORT int write_memory(void* sim, uint64_t address, uint64_t size, void* value)
                 real_sim->get_core(0)->get_mmu()->store_uint8(address + i, ((uint8_t*) value)[i]);
             }
     }   
-    real_sim->get_core(0)->get_mmu()->flush_icache();
+    spikelib_sim_t* spikelib = get_spikelib_sim(sim);
+    for (size_t i = 0; i < real_sim->nprocs(); i++) {
+        flush_hart_code(real_sim->get_core(i), spikelib->harts[i]);
+    }
     return SP_ERR_OK;
 }
 
@@ -450,54 +2198,1392 @@ EXPORT int get_memory_exception_cause(void* sim) {
 
 }
 
-EXPORT int spike_start(void* sim, uint64_t begin_address, uint64_t end_address, uint64_t timeout_us, size_t max_instruction_number) {
-    sim_t* real_sim = (sim_t*) sim;
+// =====================================
+//            MEMORY MAPPING
+// =====================================
+
+/* Gives the flags to the pages of [address, address + size), which must all
+   be mapped (was_mapped) or all unmapped, and reprograms the PMP of the
+   harts. Spike only flushes whole TLBs: they are flushed when permissions
+   are removed (with the decoded code when execution is), added ones need
+   nothing as the pages lacking them had no TLB entry for that access.
+*/
+static int update_memory_map(spikelib_sim_t* sim, reg_t address, reg_t size, uint8_t flags, bool was_mapped) {
+    memory_map_t& memory = sim->memory;
+    std::vector<std::vector<uint8_t>> previous = memory.pages;
+    bool previous_restricted = memory.restricted;
+    if (!memory.set(address, size, flags, was_mapped)) {
+        return SP_ERR_MAP_INVALID;
+    }
+    std::vector<std::pair<reg_t, uint8_t>> entries = memory.pmp_entries();
+    if (entries.size() > size_t(state_t::max_pmp)) {
+        // Too many distinct ranges for the PMP, keep the previous map
+        memory.pages = previous;
+        memory.restricted = previous_restricted;
+        return SP_ERR_MAP_INVALID;
+    }
+    uint8_t removed = 0;
+    for (size_t i = 0; i < previous.size(); i++) {
+        for (size_t page = 0; page < previous[i].size(); page++) {
+            removed |= previous[i][page] & ~memory.pages[i][page];
+        }
+    }
+    program_pmp(sim, entries);
+    if (removed != 0) {
+        flush_tlbs(sim);
+    }
+    if (removed & SPIKE_PROT_EXEC) {
+        flush_all_code(sim);
+    }
+    return SP_ERR_OK;
+}
+
+/* Maps unmapped pages of the regions given at initialization back, with
+   the given permissions (mask of spike_prot). address and size must be
+   page-aligned, in page-aligned regions. The pages keep their contents.
+*/
+EXPORT int mem_map(void* sim, uint64_t address, uint64_t size, int perms) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
     if (real_sim == NULL) {
         return SP_ERR_INVALID_SIMULATOR;
     }
-    processor_t* core = real_sim->get_core(0);
-    state_t* state = core->get_state();
+    if (perms & ~SPIKE_PROT_ALL) {
+        return SP_ERR_MAP_INVALID;
+    }
+    return update_memory_map(real_sim, address, size, PAGE_MAPPED | perms, false);
+}
 
-    // Write the begin address to the PC
-    write_register(sim, SPIKE_RISCV_REG_PC, &begin_address);
+// Unmaps mapped pages: guest accesses fail with *_UNMAPPED, host accesses too
+EXPORT int mem_unmap(void* sim, uint64_t address, uint64_t size) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    return update_memory_map(real_sim, address, size, 0, true);
+}
+
+// Changes the permissions of mapped pages: guest accesses lacking one fail with *_PROT
+EXPORT int mem_protect(void* sim, uint64_t address, uint64_t size, int perms) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (perms & ~SPIKE_PROT_ALL) {
+        return SP_ERR_MAP_INVALID;
+    }
+    return update_memory_map(real_sim, address, size, PAGE_MAPPED | perms, true);
+}
+
+/* Host memory of the sparse regions (given without content): reserved is
+   their size, resident the bytes of the pages committed by a first access
+   that are still in RAM.
+*/
+EXPORT int mem_resident_size(void* sim, uint64_t* resident, uint64_t* reserved) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    size_t host_page = sysconf(_SC_PAGESIZE);
+    *resident = 0;
+    *reserved = 0;
+    std::vector<unsigned char> pages;
+    for (host_region& region : real_sim->regions) {
+        if (!region.sparse) continue;
+        pages.resize((region.size + host_page - 1) / host_page);
+        if (mincore(region.content, region.size, pages.data()) != 0) {
+            return SP_ERR_UNKNOWN;
+        }
+        for (unsigned char page : pages) {
+            if (page & 1) *resident += host_page;
+        }
+        *reserved += region.size;
+    }
+    return SP_ERR_OK;
+}
+
+// =====================================
+//             DIRTY PAGES
+// =====================================
+
+/* Writes the addresses of the pages stored to by the guest since the
+   simulator was created or clear_dirty_pages was last called (host writes
+   are not counted) to pages, in increasing order. On entry pages_number
+   holds the capacity of pages, on return the number of addresses written;
+   with pages NULL it receives the number of dirty pages.
+*/
+EXPORT int get_dirty_pages(void* sim, uint64_t* pages, uint64_t* pages_number) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    write_tracker_t& writes = real_sim->writes;
+    std::vector<reg_t> dirty;
+    for (size_t i = 0; i < real_sim->regions.size(); i++) {
+        for (reg_t page = 0; page < writes.dirty[i].size(); page++) {
+            if (__atomic_load_n(&writes.dirty[i][page], __ATOMIC_RELAXED) == writes.dirty_epoch) {
+                dirty.push_back(real_sim->regions[i].base + (page << PGSHIFT));
+            }
+        }
+    }
+    if (pages == NULL) {
+        *pages_number = dirty.size();
+        return SP_ERR_OK;
+    }
+    std::sort(dirty.begin(), dirty.end());
+    *pages_number = std::min<uint64_t>(*pages_number, dirty.size());
+    memcpy(pages, dirty.data(), *pages_number * sizeof(uint64_t));
+    return SP_ERR_OK;
+}
+
+// Forgets the dirty pages, the next guest store to each page marks it again
+EXPORT int clear_dirty_pages(void* sim) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    real_sim->writes.dirty_epoch++;
+    flush_tlbs(real_sim);
+    return SP_ERR_OK;
+}
+
+// =====================================
+//         FILE-BACKED REGIONS
+// =====================================
+
+/* Maps size bytes of a file from offset (page-aligned) as the content of a
+   memory region, paged in on demand instead of being read and copied. With
+   shared set, guest and host writes go to the file, otherwise the mapping
+   is private and copy-on-write. A size of 0 takes the rest of the file and
+   is updated; past the end of the file the region is sparse (zero pages
+   committed on first touch). Returns NULL on failure. The content must be
+   released with mem_unmap_file, after the simulators using it.
+*/
+EXPORT void* mem_map_file(const char* path, uint64_t offset, uint64_t* size, int shared) {
+    if (path == NULL || size == NULL || offset % sysconf(_SC_PAGESIZE) != 0) {
+        return NULL;
+    }
+    int fd = open(path, shared ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || uint64_t(file_stat.st_size) < offset) {
+        close(fd);
+        return NULL;
+    }
+    uint64_t file_bytes = file_stat.st_size - offset;
+    if (*size == 0) {
+        *size = file_bytes;
+    }
+    // Reserve the whole region, then lay the file over its beginning
+    char* content = (*size != 0) ? map_sparse_content(*size) : NULL;
+    uint64_t file_part = std::min(*size, file_bytes);
+    if (content != NULL && file_part != 0
+            && mmap(content, file_part, PROT_READ | PROT_WRITE, (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        munmap(content, *size);
+        content = NULL;
+    }
+    close(fd);
+    return content;
+}
+
+// Releases a content returned by mem_map_file (shared writes reach the file)
+EXPORT int mem_unmap_file(void* content, uint64_t size) {
+    if (content == NULL || munmap(content, size) != 0) {
+        return SP_ERR_MAP_INVALID;
+    }
+    return SP_ERR_OK;
+}
+
+// =====================================
+//              ELF LOADER
+// =====================================
+
+// ELF constants used by the loader
+#define ELF_CLASS_32       1
+#define ELF_CLASS_64       2
+#define ELF_DATA_LSB       1
+#define ELF_TYPE_REL       1
+#define ELF_TYPE_EXEC      2
+#define ELF_TYPE_DYN       3
+#define ELF_MACHINE_RISCV  243
+#define ELF_PT_LOAD        1
+#define ELF_SHT_SYMTAB     2
+#define ELF_SHT_RELA       4
+#define ELF_SHT_NOBITS     8
+#define ELF_SHT_REL        9
+#define ELF_SHF_ALLOC      0x2
+#define ELF_SHN_LORESERVE  0xff00
+#define ELF_STT_NOTYPE     0
+#define ELF_STT_OBJECT     1
+#define ELF_STT_FUNC       2
+
+// File and section headers, identical in both classes but for the word size
+template <typename word>
+struct elf_header {
+    uint8_t  ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    word     entry;
+    word     phoff;
+    word     shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+};
+
+template <typename word>
+struct elf_section_header {
+    uint32_t name;
+    uint32_t type;
+    word     flags;
+    word     addr;
+    word     offset;
+    word     size;
+    uint32_t link;
+    uint32_t info;
+    word     addralign;
+    word     entsize;
+};
+
+struct elf32_program_header {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz;
+    uint32_t memsz;
+    uint32_t flags;
+    uint32_t align;
+};
+
+struct elf64_program_header {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t filesz;
+    uint64_t memsz;
+    uint64_t align;
+};
+
+struct elf32_symbol {
+    uint32_t name;
+    uint32_t value;
+    uint32_t size;
+    uint8_t  info;
+    uint8_t  other;
+    uint16_t shndx;
+};
+
+struct elf64_symbol {
+    uint32_t name;
+    uint8_t  info;
+    uint8_t  other;
+    uint16_t shndx;
+    uint64_t value;
+    uint64_t size;
+};
+
+// Layouts of an ELF class
+struct elf32 {
+    typedef uint32_t word;
+    typedef elf32_program_header program_header;
+    typedef elf32_symbol symbol;
+};
+
+struct elf64 {
+    typedef uint64_t word;
+    typedef elf64_program_header program_header;
+    typedef elf64_symbol symbol;
+};
+
+// Guest range to fill from the file (data) or with zeros (data NULL)
+typedef struct {
+    reg_t address;
+    const uint8_t* data;
+    reg_t size;
+} elf_chunk;
+
+// True if [offset, offset + count * item) lies in a file of the given size
+static inline bool elf_in_file(uint64_t offset, uint64_t count, uint64_t item, size_t file_size) {
+    return offset <= file_size && (item == 0 || count <= (file_size - offset) / item);
+}
+
+/* Copies a chunk into the host regions, the parts outside of them are
+   dropped (such as the bytes before a .org of a relocatable object).
+*/
+static void load_elf_chunk(spikelib_sim_t* sim, const elf_chunk& chunk) {
+    for (host_region& region : sim->regions) {
+        reg_t begin = std::max(chunk.address, region.base);
+        reg_t end   = std::min(chunk.address + chunk.size, region.base + region.size);
+        if (begin >= end) continue;
+        char* destination = region.content + (begin - region.base);
+        if (chunk.data != NULL) {
+            memcpy(destination, chunk.data + (begin - chunk.address), end - begin);
+        } else {
+            memset(destination, 0, end - begin);
+        }
+        sim->writes.stamp(begin, end - begin);
+        invalidate_code_range(sim, begin, end - begin);
+    }
+}
+
+/* Loads an ELF image of the given class. Executables and shared objects are
+   loaded by PT_LOAD segments. Relocatable objects (an assembled file) are
+   loaded by allocated sections: sections without an address are laid out
+   one after the other from 0, so a .org in the first one is honored. Their
+   relocations are not applied, objects needing some are refused. Nothing
+   is written before the whole file is checked.
+*/
+template <typename ELF>
+static int load_elf_image(spikelib_sim_t* sim, const uint8_t* image, size_t file_size) {
+    typedef elf_header<typename ELF::word> header_t;
+    typedef elf_section_header<typename ELF::word> section_t;
+    if (file_size < sizeof(header_t)) {
+        return SP_ERR_ELF_INVALID;
+    }
+    const header_t* header = (const header_t*) image;
+    if (header->machine != ELF_MACHINE_RISCV) {
+        return SP_ERR_ELF_INVALID;
+    }
+    const section_t* sections = NULL;
+    size_t sections_number = 0;
+    if (header->shnum != 0) {
+        if (header->shentsize != sizeof(section_t) || !elf_in_file(header->shoff, header->shnum, sizeof(section_t), file_size)) {
+            return SP_ERR_ELF_INVALID;
+        }
+        sections = (const section_t*) (image + header->shoff);
+        sections_number = header->shnum;
+    }
+
+    std::vector<elf_chunk> chunks;
+    // Load address of each section, symbol values of relocatable objects are relative to it
+    std::vector<reg_t> section_addresses(sections_number, 0);
+    bool relocatable = header->type == ELF_TYPE_REL;
+    if (relocatable) {
+        reg_t next = 0;
+        for (size_t i = 0; i < sections_number; i++) {
+            const section_t& section = sections[i];
+            if ((section.type == ELF_SHT_RELA || section.type == ELF_SHT_REL) && section.size != 0
+                    && section.info < sections_number && (sections[section.info].flags & ELF_SHF_ALLOC)) {
+                return SP_ERR_ELF_INVALID;
+            }
+            if (!(section.flags & ELF_SHF_ALLOC) || section.size == 0) continue;
+            reg_t align = std::max<reg_t>(section.addralign, 1);
+            reg_t address = (section.addr != 0) ? reg_t(section.addr) : (next + align - 1) & ~(align - 1);
+            section_addresses[i] = address;
+            next = address + section.size;
+            if (section.type == ELF_SHT_NOBITS) {
+                chunks.push_back({ .address = address, .data = NULL, .size = section.size });
+            } else if (elf_in_file(section.offset, section.size, 1, file_size)) {
+                chunks.push_back({ .address = address, .data = image + section.offset, .size = section.size });
+            } else {
+                return SP_ERR_ELF_INVALID;
+            }
+        }
+    } else if (header->type == ELF_TYPE_EXEC || header->type == ELF_TYPE_DYN) {
+        typedef typename ELF::program_header segment_t;
+        if (header->phnum != 0 && (header->phentsize != sizeof(segment_t) || !elf_in_file(header->phoff, header->phnum, sizeof(segment_t), file_size))) {
+            return SP_ERR_ELF_INVALID;
+        }
+        const segment_t* segments = (const segment_t*) (image + header->phoff);
+        for (size_t i = 0; i < header->phnum; i++) {
+            const segment_t& segment = segments[i];
+            if (segment.type != ELF_PT_LOAD) continue;
+            if (segment.filesz > segment.memsz || !elf_in_file(segment.offset, segment.filesz, 1, file_size)) {
+                return SP_ERR_ELF_INVALID;
+            }
+            chunks.push_back({ .address = segment.paddr, .data = image + segment.offset, .size = segment.filesz });
+            if (segment.memsz > segment.filesz) {
+                // Zero-filled tail (.bss)
+                chunks.push_back({ .address = segment.paddr + segment.filesz, .data = NULL, .size = segment.memsz - segment.filesz });
+            }
+        }
+    } else {
+        return SP_ERR_ELF_INVALID;
+    }
+
+    // Symbols naming code or data, with their addresses once loaded
+    std::vector<elf_symbol> symbols;
+    typedef typename ELF::symbol symbol_t;
+    for (size_t i = 0; i < sections_number; i++) {
+        const section_t& table = sections[i];
+        if (table.type != ELF_SHT_SYMTAB) continue;
+        if (table.link >= sections_number || !elf_in_file(table.offset, table.size / sizeof(symbol_t), sizeof(symbol_t), file_size)) {
+            return SP_ERR_ELF_INVALID;
+        }
+        const section_t& strings = sections[table.link];
+        if (!elf_in_file(strings.offset, strings.size, 1, file_size)) {
+            return SP_ERR_ELF_INVALID;
+        }
+        const symbol_t* entries = (const symbol_t*) (image + table.offset);
+        const char* names = (const char*) (image + strings.offset);
+        for (size_t j = 0; j < table.size / sizeof(symbol_t); j++) {
+            const symbol_t& entry = entries[j];
+            unsigned type = entry.info & 0xf;
+            if ((type != ELF_STT_NOTYPE && type != ELF_STT_OBJECT && type != ELF_STT_FUNC)
+                    || entry.shndx == 0 || entry.shndx >= ELF_SHN_LORESERVE || entry.name == 0 || entry.name >= strings.size) {
+                continue;
+            }
+            reg_t address = entry.value;
+            if (relocatable) {
+                if (entry.shndx >= sections_number) continue;
+                address += section_addresses[entry.shndx];
+            }
+            symbols.push_back({ .address = address, .size = entry.size, .name = std::string(names + entry.name, strnlen(names + entry.name, strings.size - entry.name)) });
+        }
+    }
+
+    for (const elf_chunk& chunk : chunks) {
+        load_elf_chunk(sim, chunk);
+    }
+    // Merge with the symbols of the files loaded before, then index them
+    sim->symbols.insert(sim->symbols.end(), symbols.begin(), symbols.end());
+    std::stable_sort(sim->symbols.begin(), sim->symbols.end(), [](const elf_symbol& a, const elf_symbol& b) { return a.address < b.address; });
+    sim->symbols_by_name.resize(sim->symbols.size());
+    for (size_t i = 0; i < sim->symbols.size(); i++) {
+        sim->symbols_by_name[i] = i;
+    }
+    std::vector<elf_symbol>& all = sim->symbols;
+    std::stable_sort(sim->symbols_by_name.begin(), sim->symbols_by_name.end(), [&all](size_t a, size_t b) { return all[a].name < all[b].name; });
+    return SP_ERR_OK;
+}
+
+/* Loads a RISC-V ELF file (32 or 64 bits) into the memory regions of a
+   simulator and indexes its symbols for get_symbol_address and
+   get_address_symbol. The file is mapped, not read, and only the loaded
+   bytes are copied; those falling outside of the regions are dropped.
+*/
+EXPORT int load_elf(void* sim, const char* path) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return SP_ERR_ELF_INVALID;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < 16) {
+        close(fd);
+        return SP_ERR_ELF_INVALID;
+    }
+    size_t file_size = file_stat.st_size;
+    void* mapped = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return SP_ERR_ELF_INVALID;
+    }
+    const uint8_t* image = (const uint8_t*) mapped;
+    int res = SP_ERR_ELF_INVALID;
+    if (memcmp(image, "\177ELF", 4) == 0 && image[5] == ELF_DATA_LSB) {
+        if (image[4] == ELF_CLASS_64) {
+            res = load_elf_image<elf64>(real_sim, image, file_size);
+        } else if (image[4] == ELF_CLASS_32) {
+            res = load_elf_image<elf32>(real_sim, image, file_size);
+        }
+    }
+    munmap(mapped, file_size);
+    return res;
+}
+
+// Address of the symbol with the given name (the lowest one if several share it)
+EXPORT int get_symbol_address(void* sim, const char* name, uint64_t* address) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    std::vector<elf_symbol>& symbols = real_sim->symbols;
+    std::string wanted(name);
+    auto found = std::lower_bound(real_sim->symbols_by_name.begin(), real_sim->symbols_by_name.end(), wanted,
+        [&symbols](size_t index, const std::string& wanted) { return symbols[index].name < wanted; });
+    if (found == real_sim->symbols_by_name.end() || symbols[*found].name != wanted) {
+        return SP_ERR_UNKNOWN;
+    }
+    *address = symbols[*found].address;
+    return SP_ERR_OK;
+}
+
+/* Symbol holding address and the offset of address in it. The name stays
+   valid until the next load_elf or the release of the simulator.
+*/
+EXPORT int get_address_symbol(void* sim, uint64_t address, const char** name, uint64_t* offset) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    const elf_symbol* symbol = find_address_symbol(real_sim, address);
+    if (symbol == NULL) {
+        return SP_ERR_UNKNOWN;
+    }
+    *name   = symbol->name.c_str();
+    *offset = address - symbol->address;
+    return SP_ERR_OK;
+}
+
+// =====================================
+//             RUN ENGINE
+// =====================================
+
+/* Run of one hart between its start and a stop condition. A run can be
+   advanced by slices of a given number of instructions, which lets several
+   harts be interleaved deterministically.
+*/
+typedef struct {
+    uint64_t end_address;
+    size_t max_instruction_number;
+    size_t instruction_count;
+    timeout_clock timer;
+    int result;
+} hart_run;
+
+static void hart_run_init(hart_run* run, uint64_t end_address, uint64_t timeout_us, size_t max_instruction_number) {
+    run->end_address            = end_address;
+    run->max_instruction_number = max_instruction_number;
+    run->instruction_count      = 0;
+    run->result                 = SP_ERR_UNKNOWN;
     // Initialize the timer
-    int64_t current_time_us = get_clock_realtime();
-    // Check for the end address to be ok, if not STOP execution directly
+    timeout_clock_start(&run->timer, timeout_us);
+}
+
+static void hart_run_start(spikelib_sim_t* sim, size_t hartid, hart_run* run, uint64_t begin_address, uint64_t end_address, uint64_t timeout_us, size_t max_instruction_number) {
+    // Write the begin address to the PC
+    sim->get_core(hartid)->get_state()->pc = begin_address;
+    hart_run_init(run, end_address, timeout_us, max_instruction_number);
+    // Start the cumulative accounting spike_resume continues
+    hart_context& hart = sim->harts[hartid];
+    hart.run_end_address  = end_address;
+    hart.run_instructions = 0;
+    hart.run_time_us      = 0;
+}
+
+// Consecutive retries of the same faulting access an invalid memory hook may
+// ask for before the run stops with the access error
+#define MAX_ACCESS_RETRIES 16
+
+// Optional features of the run loop, each one a template specialization
+#define RUN_PROFILE    (1 << 0)  // Execution profile
+#define RUN_TRACE      (1 << 1)  // Instruction trace
+#define RUN_CODE_HOOKS (1 << 2)  // SPIKE_HOOK_CODE hooks
+#define RUN_TRAP_HOOKS (1 << 3)  // SPIKE_HOOK_INTR and SPIKE_HOOK_MEM_INVALID hooks
+#define RUN_FEATURES   (1 << 4)  // Number of specializations
+
+/* Run loop of hart_run_advance, specialized on the optional features so
+   that disabled ones cost no branch per block.
+*/
+template <unsigned FEATURES>
+static bool hart_run_loop(spikelib_sim_t* sim, size_t hartid, hart_run* run, size_t quantum) {
+    const bool PROFILE    = (FEATURES & RUN_PROFILE) != 0;
+    const bool TRACE      = (FEATURES & RUN_TRACE) != 0;
+    const bool CODE_HOOKS = (FEATURES & RUN_CODE_HOOKS) != 0;
+    const bool TRAP_HOOKS = (FEATURES & RUN_TRAP_HOOKS) != 0;
+    // Traces and code hooks see every instruction, one at a time
+    const bool SINGLE_STEP = TRACE || CODE_HOOKS;
+    processor_t* core = sim->get_core(hartid);
+    state_t* state = core->get_state();
+    hart_context& hart = sim->harts[hartid];
+    size_t slice_end = (quantum != 0) ? run->instruction_count + quantum : SIZE_MAX;
+
     bool has_timed_out     = false;
     bool has_reached_count = false;
     bool has_reached_end   = false;
+    bool has_hit_breakpoint = false;
     bool has_mem_exception = false;
-    int instruction_count = 0;
-    uint64_t previous_pc = 0;
-    while(!has_reached_end && !has_timed_out && !has_reached_count && !has_mem_exception) {
-        previous_pc = state->pc;
-        core->step(1);
+    bool has_stopped       = false;
+    trap_event trap = { .taken = false, .error = SP_ERR_OK, .supervisor = false, .cause = 0, .address = 0 };
+    // Faulting access (pc and address) retried last, and how many times in a row
+    reg_t retry_pc = ~reg_t(0);
+    reg_t retry_address = ~reg_t(0);
+    unsigned retries = 0;
+    // The instruction that hit a watchpoint in the previous run is not stopped on again
+    bool step_over = hart.watcher.step_over && state->pc == hart.watcher.hit_pc;
+    hart.watcher.step_over = false;
+    while(!has_reached_end && !has_hit_breakpoint && !has_timed_out && !has_reached_count && !has_mem_exception && !has_stopped) {
+        if (run->instruction_count >= slice_end) return false;
+        // Size the batch on the cached block, the remaining instruction budget and the end address
+        size_t budget = (SINGLE_STEP || step_over) ? 1 : MAX_BATCH_INSTRUCTIONS;
+        if (run->max_instruction_number != 0 && run->max_instruction_number - run->instruction_count < budget) {
+            budget = run->max_instruction_number - run->instruction_count;
+        }
+        if (slice_end - run->instruction_count < budget) {
+            budget = slice_end - run->instruction_count;
+        }
+        cached_block& block = next_block(hart, core, state->pc, run->end_address, sim->breakpoints, sim->jit_mode != SPIKE_JIT_OFF);
+        reg_t block_pc = block.pc;
+        size_t batch = std::min(block.length, budget);
+        reg_t retired_before = state->minstret;
+        trap_csrs csrs_before = save_trap_csrs(state);
+        spike_trace_record record;
+        if (TRACE) {
+            trace_before(hart, core, &record);
+        }
+        if (CODE_HOOKS) {
+            run_code_hooks(sim, hart, core, state->pc);
+        }
+        if (!SINGLE_STEP && sim->jit_mode != SPIKE_JIT_OFF && block.cacheable && block.native == NULL && batch == block.length
+                && ++block.hits == JIT_HOT_THRESHOLD && jit_supported(core)) {
+            translate_block(hart, core, block);
+        }
+        // Translated blocks only run whole, and never with an interrupt pending (Spike would take it first)
+        if (!SINGLE_STEP && sim->jit_mode != SPIKE_JIT_OFF && block.native != NULL && batch == block.length && (state->mip & state->mie) == 0) {
+            run_native_block(sim, hart, core, block);
+        } else if (step_over) {
+            hart.watcher.armed = false;
+            core->step(batch);
+            hart.watcher.armed = true;
+            step_over = false;
+        } else {
+            core->step(batch);
+        }
+        if (block.fence_i) {
+            flush_hart_code(core, hart);
+        }
+        // Spike stops a batch early on a trap, the trapping instruction counts as executed.
+        // The guest can write minstret, so it only locates traps: a batch without one ran whole
+        size_t retired = std::min<reg_t>(state->minstret - retired_before, batch);
+        trap = check_trap_event(sim->memory, state, csrs_before, batch, retired);
+        if (!trap.taken) {
+            retired = batch;
+        }
+        bool watch_hit = trap.taken && hart.watcher.pending;
+        if (watch_hit) {
+            // Breakpoint raised by the watch tracer, the accessing instruction runs again on resume
+            hart.watcher.pending = false;
+            undo_watch_trap(state, csrs_before, trap);
+            hart.watcher.step_over = true;
+            hart.watcher.hit_pc    = state->pc;
+            trap.error = SP_ERR_WATCHPOINT;
+        }
+        bool retry = false;
+        if (TRAP_HOOKS && trap.taken && run_trap_hooks(sim, trap)) {
+            // An invalid memory hook fixed the access, the instruction runs again.
+            // Retries do not retire anything, so a hook that never really fixes
+            // the access is bounded here rather than by the timeout
+            reg_t fault_pc = trap.supervisor ? state->sepc : state->mepc;
+            retries = (fault_pc == retry_pc && trap.address == retry_address) ? retries + 1 : 1;
+            retry_pc      = fault_pc;
+            retry_address = trap.address;
+            if (retries <= MAX_ACCESS_RETRIES) {
+                return_from_trap(core, trap);
+                trap.error = SP_ERR_OK;
+                retry = true;
+            }
+        }
+        run->instruction_count += (trap.taken && !retry && !watch_hit) ? retired + 1 : retired;
+        if (PROFILE && retired != 0) {
+            hart.profile.record(block_pc, retired, trap.taken ? PROFILE_NO_EDGE : state->pc);
+        }
+        if (TRACE) {
+            trace_after(core, &record, trap.taken);
+            hart.tracer->push(record);
+        }
         // Check time out, instruction count and final pc
-        has_timed_out     = !(((uint64_t)(get_clock_realtime() - current_time_us) < timeout_us) || timeout_us == 0);
-        has_reached_count = (++instruction_count == max_instruction_number) && (max_instruction_number != 0);
-        has_reached_end   = (state->pc == end_address);
-        has_mem_exception = (get_memory_exception_cause(sim) != SP_ERR_OK);
+        has_timed_out     = timeout_clock_expired(&run->timer, run->instruction_count);
+        has_reached_count = (run->instruction_count >= run->max_instruction_number) && (run->max_instruction_number != 0);
+        has_reached_end   = (state->pc == run->end_address);
+        has_hit_breakpoint = sim->breakpoints.contains(state->pc);
+        has_mem_exception = trap.taken && (trap.error != SP_ERR_OK);
+        has_stopped       = sim->stop_requested.load(std::memory_order_relaxed);
     }
-    
-    if (has_reached_end)   return SP_ERR_OK;
-    if (has_reached_count) return SP_ERR_MAX_COUNT;
-    if (has_timed_out)     return SP_ERR_TIMEOUT;
-    if (has_mem_exception) {
-        // Return an error code from the mcause value
-        int error_code = get_memory_exception_cause(sim);
-        // Set the pc to the one that caused the exception
-        reg_t previous_pc = state->mepc;
-        state->pc = previous_pc;
-        // Reallow interruptions (by default when handling an exception, the processor refuses to take anymore)
-        reg_t s = state->mstatus;
-        s = set_field(s, MSTATUS_MIE, 1);
-        core->set_csr(CSR_MSTATUS, s);
-        return error_code;
+
+    if (has_reached_end) {
+        run->result = SP_ERR_OK;
+    } else if (has_hit_breakpoint) {
+        run->result = SP_ERR_BREAKPOINT;
+        hart.hit_breakpoint = state->pc;
+    } else if (has_reached_count) {
+        run->result = SP_ERR_MAX_COUNT;
+    } else if (has_timed_out) {
+        run->result = SP_ERR_TIMEOUT;
+    } else if (has_stopped && !has_mem_exception) {
+        run->result = SP_ERR_STOPPED;
+    } else {
+        // Return the error code recorded by the trap event
+        run->result = trap.error;
+        // Set the pc to the one that caused the exception and reallow interruptions
+        // (by default when handling an exception, the processor refuses to take anymore).
+        // Watchpoint traps were already undone
+        if (trap.error != SP_ERR_WATCHPOINT) {
+            return_from_trap(core, trap);
+        }
+    }
+    return true;
+}
+
+typedef bool (*hart_run_loop_fn)(spikelib_sim_t* sim, size_t hartid, hart_run* run, size_t quantum);
+
+// Specializations of hart_run_loop indexed by their features
+static const hart_run_loop_fn hart_run_loops[RUN_FEATURES] = {
+    hart_run_loop<0>,  hart_run_loop<1>,  hart_run_loop<2>,  hart_run_loop<3>,
+    hart_run_loop<4>,  hart_run_loop<5>,  hart_run_loop<6>,  hart_run_loop<7>,
+    hart_run_loop<8>,  hart_run_loop<9>,  hart_run_loop<10>, hart_run_loop<11>,
+    hart_run_loop<12>, hart_run_loop<13>, hart_run_loop<14>, hart_run_loop<15>
+};
+
+/* Advances a run by at most quantum instructions (0 for no limit).
+   Returns true once a stop condition is reached, run->result then holds the
+   code spike_start returns.
+*/
+static bool hart_run_advance(spikelib_sim_t* sim, size_t hartid, hart_run* run, size_t quantum) {
+    hart_context& hart = sim->harts[hartid];
+    unsigned features = 0;
+    if (sim->profiling)                                         features |= RUN_PROFILE;
+    if (hart.tracer != NULL)                                    features |= RUN_TRACE;
+    if (sim->hook_types & SPIKE_HOOK_CODE)                      features |= RUN_CODE_HOOKS;
+    if (sim->hook_types & (SPIKE_HOOK_INTR | SPIKE_HOOK_MEM_INVALID)) features |= RUN_TRAP_HOOKS;
+    hart.watcher.armed   = true;
+    hart.mem_hooks.armed = true;
+    size_t count_before = run->instruction_count;
+    int64_t start_us = get_clock_realtime_us();
+    bool stopped = hart_run_loops[features](sim, hartid, run, quantum);
+    hart.run_time_us      += (uint64_t)(get_clock_realtime_us() - start_us);
+    hart.run_instructions += run->instruction_count - count_before;
+    hart.watcher.armed   = false;
+    hart.mem_hooks.armed = false;
+    return stopped;
+}
+
+// Runs a hart until a stop condition, without clearing stop requests
+static int run_hart(spikelib_sim_t* sim, int hartid, uint64_t begin_address, uint64_t end_address, uint64_t timeout_us, size_t max_instruction_number) {
+    hart_run run;
+    hart_run_start(sim, hartid, &run, begin_address, end_address, timeout_us, max_instruction_number);
+    hart_run_advance(sim, hartid, &run, 0);
+    return run.result;
+}
+
+EXPORT int spike_start_hart(void* sim, int hartid, uint64_t begin_address, uint64_t end_address, uint64_t timeout_us, size_t max_instruction_number) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
     }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    real_sim->stop_requested.store(false);
+    return run_hart(real_sim, hartid, begin_address, end_address, timeout_us, max_instruction_number);
+}
+
+EXPORT int spike_start(void* sim, uint64_t begin_address, uint64_t end_address, uint64_t timeout_us, size_t max_instruction_number) {
+    return spike_start_hart(sim, 0, begin_address, end_address, timeout_us, max_instruction_number);
+}
 
+/* Continues a hart from its current state for at most budget instructions
+   (0 for no limit), without writing the PC. The run keeps the end address
+   of the last spike_start and the breakpoints, has no timeout, and returns
+   SP_ERR_MAX_COUNT once the budget is spent. Its instructions and time add
+   up with those of the start in spike_run_stats.
+*/
+EXPORT int spike_resume_hart(void* sim, int hartid, size_t budget) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    real_sim->stop_requested.store(false);
+    hart_run run;
+    hart_run_init(&run, real_sim->harts[hartid].run_end_address, 0, budget);
+    hart_run_advance(real_sim, hartid, &run, 0);
+    return run.result;
+}
+
+EXPORT int spike_resume(void* sim, size_t budget) {
+    return spike_resume_hart(sim, 0, budget);
+}
+
+// Instructions run and wall time spent by a hart since its last spike_start, resumes included
+EXPORT int spike_run_stats(void* sim, int hartid, uint64_t* instructions, uint64_t* elapsed_us) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    *instructions = real_sim->harts[hartid].run_instructions;
+    *elapsed_us   = real_sim->harts[hartid].run_time_us;
+    return SP_ERR_OK;
+}
+
+/* Run harts 0 to harts_number - 1 until each one reaches a stop condition.
+   Hart i starts at begin_addresses[i], stops at end_addresses[i] and its
+   code is written to results[i]. With lockstep_quantum == 0 the harts run
+   concurrently on host threads over the shared memory regions; otherwise
+   they are interleaved on the calling thread, lockstep_quantum instructions
+   at a time in hart order, which is deterministic.
+   Concurrent harts give no atomicity guarantee: Spike runs an AMO as a load
+   then a store, and a store does not clear the reservations of the other
+   harts' MMUs, so AMOs and LR/SC race across host threads. Guests that
+   synchronize harts must run in lockstep, where instructions never overlap
+   and a hart's reservation is dropped when its quantum ends (SC may fail
+   spuriously; a quantum of 16 instructions or more keeps LR/SC loops
+   making progress).
+*/
+EXPORT int spike_start_harts(void* sim, int harts_number, uint64_t* begin_addresses, uint64_t* end_addresses, uint64_t timeout_us, size_t max_instruction_number, int* results, size_t lockstep_quantum) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (harts_number <= 0 || (size_t) harts_number > real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    real_sim->stop_requested.store(false);
+    if (lockstep_quantum == 0) {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < harts_number; i++) {
+            threads.push_back(std::thread([=]() {
+                results[i] = run_hart(real_sim, i, begin_addresses[i], end_addresses[i], timeout_us, max_instruction_number);
+            }));
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        return SP_ERR_OK;
+    }
+    std::vector<hart_run> runs(harts_number);
+    std::vector<bool> finished(harts_number, false);
+    for (int i = 0; i < harts_number; i++) {
+        hart_run_start(real_sim, i, &runs[i], begin_addresses[i], end_addresses[i], timeout_us, max_instruction_number);
+    }
+    int running = harts_number;
+    while (running > 0) {
+        for (int i = 0; i < harts_number; i++) {
+            if (finished[i]) continue;
+            bool stopped = hart_run_advance(real_sim, i, &runs[i], lockstep_quantum);
+            // The other harts run next and their stores would not break the reservation
+            real_sim->get_core(i)->get_mmu()->yield_load_reservation();
+            if (!stopped) continue;
+            finished[i] = true;
+            results[i]  = runs[i].result;
+            running--;
+        }
+    }
+    return SP_ERR_OK;
+}
+
+/* Starts spike_start on a thread owned by the library and returns at once.
+   While it runs, only spike_poll, spike_wait and spike_stop may be called
+   on the simulator. Fails with SP_ERR_UNKNOWN if a run is in progress.
+*/
+EXPORT int spike_start_async(void* sim, uint64_t begin_address, uint64_t end_address, uint64_t timeout_us, size_t max_instruction_number) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (real_sim->async_started && !real_sim->async_finished.load()) {
+        return SP_ERR_UNKNOWN;
+    }
+    if (real_sim->async_worker.joinable()) {
+        real_sim->async_worker.join();
+    }
+    real_sim->stop_requested.store(false);
+    real_sim->async_started = true;
+    real_sim->async_finished.store(false);
+    real_sim->async_worker = std::thread([=]() {
+        real_sim->async_result = run_hart(real_sim, 0, begin_address, end_address, timeout_us, max_instruction_number);
+        real_sim->async_finished.store(true);
+    });
+    return SP_ERR_OK;
+}
+
+/* Tells if the last asynchronous run finished (finished set to 1) and then
+   writes its code to result. Does not block.
+*/
+EXPORT int spike_poll(void* sim, int* finished, int* result) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (!real_sim->async_started) {
+        return SP_ERR_UNKNOWN;
+    }
+    *finished = real_sim->async_finished.load() ? 1 : 0;
+    if (*finished) {
+        *result = real_sim->async_result;
+    }
+    return SP_ERR_OK;
+}
+
+// Waits for the last asynchronous run and returns its code
+EXPORT int spike_wait(void* sim) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (!real_sim->async_started) {
+        return SP_ERR_UNKNOWN;
+    }
+    if (real_sim->async_worker.joinable()) {
+        real_sim->async_worker.join();
+    }
+    return real_sim->async_result;
+}
+
+/* Asks the current run of the simulator (synchronous or not, on any hart)
+   to stop with SP_ERR_STOPPED at its next block boundary. Can be called
+   from any thread; a request made while nothing runs is dropped by the
+   next run.
+*/
+EXPORT int spike_stop(void* sim) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    real_sim->stop_requested.store(true);
+    return SP_ERR_OK;
+}
+
+
+/* Selects the native translation tier of the simulator (spike_jit_mode).
+   Must not be called while the simulator runs. The tier only covers RV64IM
+   cores on x86-64 hosts, elsewhere every block stays on Spike.
+*/
+EXPORT int spike_set_jit(void* sim, int mode) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (mode != SPIKE_JIT_OFF && mode != SPIKE_JIT_ON && mode != SPIKE_JIT_DIFFERENTIAL) {
+        return SP_ERR_UNKNOWN;
+    }
+    if ((mode == SPIKE_JIT_OFF) != (real_sim->jit_mode == SPIKE_JIT_OFF)) {
+        // Blocks scanned with the JIT off lack the instruction bits to translate
+        flush_all_code(real_sim);
+    }
+    real_sim->jit_mode = mode;
+    return SP_ERR_OK;
+}
+
+// Counters of the native tier summed over the harts: blocks translated, translated blocks run and differential mismatches
+EXPORT int spike_jit_stats(void* sim, uint64_t* translations, uint64_t* native_runs, uint64_t* mismatches) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    *translations = 0;
+    *native_runs = 0;
+    *mismatches = 0;
+    for (hart_context& hart : real_sim->harts) {
+        *translations += hart.jit_translations;
+        *native_runs  += hart.jit_native_runs;
+        *mismatches   += hart.jit_mismatches;
+    }
+    return SP_ERR_OK;
+}
+
+// =====================================
+//          EXECUTION PROFILE
+// =====================================
+
+/* Expands the block counts of every hart into per-pc and per-taken-edge
+   counts. Blocks are walked again along the path scan_block followed, so
+   the profile is resolved against the code currently in memory. Direct
+   jumps inside a block and block exits other than the fall-through (taken
+   branches, indirect jumps) are edges.
+*/
+static void resolve_profile(spikelib_sim_t* sim, std::unordered_map<reg_t, uint64_t>& pcs, std::map<std::pair<reg_t, reg_t>, uint64_t>& edges) {
+    for (size_t i = 0; i < sim->harts.size(); i++) {
+        processor_t* core = sim->get_core(i);
+        for (profile_entry& entry : sim->harts[i].profile.entries) {
+            if (entry.pc == ~reg_t(0)) continue;
+            reg_t pc = entry.pc;
+            for (uint64_t n = 0; n < entry.length; n++) {
+                insn_fetch_t fetched;
+                try {
+                    fetched = fetch_code(sim->harts[i], core, pc);
+                } catch (trap_t& t) {
+                    break;
+                }
+                pcs[pc] += entry.count;
+                reg_t next_pc = pc + fetched.insn.length();
+                if (n + 1 == entry.length) {
+                    if (entry.next_pc != PROFILE_NO_EDGE && entry.next_pc != next_pc) {
+                        edges[std::make_pair(pc, entry.next_pc)] += entry.count;
+                    }
+                    break;
+                }
+                if (direct_jump_target(fetched.insn, pc, &next_pc)) {
+                    edges[std::make_pair(pc, next_pc)] += entry.count;
+                }
+                pc = next_pc;
+            }
+        }
+    }
+}
+
+// Sorted by decreasing count, then increasing pc
+static std::vector<spike_profile_pc> sorted_profile_pcs(std::unordered_map<reg_t, uint64_t>& pcs) {
+    std::vector<spike_profile_pc> sorted;
+    for (auto& pc : pcs) {
+        sorted.push_back({ .pc = pc.first, .count = pc.second });
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const spike_profile_pc& a, const spike_profile_pc& b) {
+        return a.count != b.count ? a.count > b.count : a.pc < b.pc;
+    });
+    return sorted;
+}
+
+static std::vector<spike_profile_edge> sorted_profile_edges(std::map<std::pair<reg_t, reg_t>, uint64_t>& edges) {
+    std::vector<spike_profile_edge> sorted;
+    for (auto& edge : edges) {
+        sorted.push_back({ .from = edge.first.first, .to = edge.first.second, .count = edge.second });
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const spike_profile_edge& a, const spike_profile_edge& b) {
+        return a.count > b.count;
+    });
+    return sorted;
+}
+
+// Starts (enabled != 0) or stops profiling the next runs, counts are kept until spike_profile_reset
+EXPORT int spike_profile_enable(void* sim, int enabled) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    real_sim->profiling = (enabled != 0);
+    return SP_ERR_OK;
+}
+
+EXPORT int spike_profile_reset(void* sim) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    for (hart_context& hart : real_sim->harts) {
+        hart.profile.clear();
+    }
+    return SP_ERR_OK;
+}
+
+/* Writes the hottest pcs to pcs (a spike_profile_pc array) and the hottest
+   taken edges to edges (a spike_profile_edge array, may be NULL). On entry
+   pcs_number and edges_number hold the capacity of the arrays, on return
+   the number of entries written.
+*/
+EXPORT int spike_profile_top(void* sim, void* pcs, uint64_t* pcs_number, void* edges, uint64_t* edges_number) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    std::unordered_map<reg_t, uint64_t> pc_counts;
+    std::map<std::pair<reg_t, reg_t>, uint64_t> edge_counts;
+    resolve_profile(real_sim, pc_counts, edge_counts);
+
+    std::vector<spike_profile_pc> top_pcs = sorted_profile_pcs(pc_counts);
+    *pcs_number = std::min<uint64_t>(*pcs_number, top_pcs.size());
+    memcpy(pcs, top_pcs.data(), *pcs_number * sizeof(spike_profile_pc));
+    if (edges != NULL) {
+        std::vector<spike_profile_edge> top_edges = sorted_profile_edges(edge_counts);
+        *edges_number = std::min<uint64_t>(*edges_number, top_edges.size());
+        memcpy(edges, top_edges.data(), *edges_number * sizeof(spike_profile_edge));
+    }
+    return SP_ERR_OK;
+}
+
+/* Writes the whole profile to a text file, hottest first: one
+   "pc <pc> <count>" line per pc, then one "edge <from> <to> <count>" line
+   per taken edge.
+*/
+EXPORT int spike_profile_dump(void* sim, const char* path) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return SP_ERR_UNKNOWN;
+    }
+    std::unordered_map<reg_t, uint64_t> pc_counts;
+    std::map<std::pair<reg_t, reg_t>, uint64_t> edge_counts;
+    resolve_profile(real_sim, pc_counts, edge_counts);
+    for (spike_profile_pc& pc : sorted_profile_pcs(pc_counts)) {
+        // Symbolized when an ELF file provided symbols
+        const elf_symbol* symbol = find_address_symbol(real_sim, pc.pc);
+        if (symbol != NULL) {
+            fprintf(file, "pc 0x%lx %lu %s+0x%lx\n", pc.pc, pc.count, symbol->name.c_str(), pc.pc - symbol->address);
+        } else {
+            fprintf(file, "pc 0x%lx %lu\n", pc.pc, pc.count);
+        }
+    }
+    for (spike_profile_edge& edge : sorted_profile_edges(edge_counts)) {
+        fprintf(file, "edge 0x%lx 0x%lx %lu\n", edge.from, edge.to, edge.count);
+    }
+    return fclose(file) == 0 ? SP_ERR_OK : SP_ERR_UNKNOWN;
+}
+
+// =====================================
+//            WATCHPOINTS
+// =====================================
+
+// Rebuilds the per-page filter and drops the TLB entries of newly watched pages
+static void update_watched_pages(spikelib_sim_t* sim) {
+    sim->watches.pages.clear();
+    for (watchpoint& range : sim->watches.ranges) {
+        for (reg_t page = range.address >> PGSHIFT; page <= (range.address + range.size - 1) >> PGSHIFT; page++) {
+            sim->watches.pages[page] |= range.kind;
+        }
+    }
+    flush_tlbs(sim);
+}
+
+/* Stops the next runs with SP_ERR_WATCHPOINT when a guest load (kind
+   SPIKE_WATCH_READ) or store (SPIKE_WATCH_WRITE) touches [address,
+   address + size). The pc is left on the accessing instruction and the
+   guest CSRs are untouched; a run resumed there runs the access again
+   without stopping on it.
+*/
+EXPORT int add_watchpoint(void* sim, uint64_t address, uint64_t size, int kind) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (size == 0 || address + size < address) {
+        return SP_ERR_MAP_INVALID;
+    }
+    if (kind == 0 || (kind & ~SPIKE_WATCH_ACCESS) != 0) {
+        return SP_ERR_UNKNOWN;
+    }
+    watchpoint range = { .address = address, .size = size, .kind = kind };
+    real_sim->watches.ranges.push_back(range);
+    update_watched_pages(real_sim);
+    return SP_ERR_OK;
+}
+
+// Removes a watchpoint added with the same address, size and kind
+EXPORT int remove_watchpoint(void* sim, uint64_t address, uint64_t size, int kind) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    std::vector<watchpoint>& ranges = real_sim->watches.ranges;
+    for (auto range = ranges.begin(); range != ranges.end(); range++) {
+        if (range->address == address && range->size == size && range->kind == kind) {
+            ranges.erase(range);
+            update_watched_pages(real_sim);
+            return SP_ERR_OK;
+        }
+    }
     return SP_ERR_UNKNOWN;
 }
 
+// Address and kind (SPIKE_WATCH_READ or SPIKE_WATCH_WRITE) of the access that last hit a watchpoint on the hart
+EXPORT int get_hit_watchpoint(void* sim, int hartid, uint64_t* address, int* kind) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    *address = real_sim->harts[hartid].watcher.hit_address;
+    *kind    = real_sim->harts[hartid].watcher.hit_kind;
+    return SP_ERR_OK;
+}
+
+// =====================================
+//               HOOKS
+// =====================================
+
+/* Installs a callback of the given type (spike_hook_type) for addresses in
+   [begin, end] (begin > end for all addresses), see spikelib.h for the
+   callback signatures. SPIKE_HOOK_MEM_READ and SPIKE_HOOK_MEM_WRITE may be
+   combined, other types are installed alone. The id to give to hook_del is
+   written to hook_id.
+*/
+EXPORT int hook_add(void* sim, uint64_t* hook_id, int type, void* callback, void* user_data, uint64_t begin, uint64_t end) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    bool mem_access = type != 0 && (type & ~(SPIKE_HOOK_MEM_READ | SPIKE_HOOK_MEM_WRITE)) == 0;
+    if (callback == NULL || !(mem_access || type == SPIKE_HOOK_CODE || type == SPIKE_HOOK_MEM_INVALID || type == SPIKE_HOOK_INTR)) {
+        return SP_ERR_UNKNOWN;
+    }
+    hook installed = { .id = real_sim->next_hook_id++, .type = type, .callback = callback, .user_data = user_data, .begin = begin, .end = end };
+    real_sim->hooks.push_back(installed);
+    real_sim->hook_types |= type;
+    if (mem_access) {
+        // Drop the TLB entries of the pages the memory hooks now trace
+        flush_tlbs(real_sim);
+    }
+    *hook_id = installed.id;
+    return SP_ERR_OK;
+}
+
+EXPORT int hook_del(void* sim, uint64_t hook_id) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    std::vector<hook>& hooks = real_sim->hooks;
+    auto found = std::find_if(hooks.begin(), hooks.end(), [hook_id](const hook& installed) { return installed.id == hook_id; });
+    if (found == hooks.end()) {
+        return SP_ERR_UNKNOWN;
+    }
+    hooks.erase(found);
+    real_sim->hook_types = 0;
+    for (const hook& installed : hooks) {
+        real_sim->hook_types |= installed.type;
+    }
+    return SP_ERR_OK;
+}
+
+// =====================================
+//            BREAKPOINTS
+// =====================================
+
+/* Stops the next runs with SP_ERR_BREAKPOINT before the instruction at
+   address is executed, like end_address. A run starting on a breakpoint
+   executes it, so a stopped run can be started again from its pc.
+*/
+EXPORT int add_breakpoint(void* sim, uint64_t address) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    real_sim->breakpoints.insert(address);
+    flush_all_code(real_sim);
+    return SP_ERR_OK;
+}
+
+EXPORT int remove_breakpoint(void* sim, uint64_t address) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (!real_sim->breakpoints.erase(address)) {
+        return SP_ERR_UNKNOWN;
+    }
+    flush_all_code(real_sim);
+    return SP_ERR_OK;
+}
+
+EXPORT int clear_breakpoints(void* sim) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    real_sim->breakpoints.clear();
+    flush_all_code(real_sim);
+    return SP_ERR_OK;
+}
+
+// Address of the breakpoint the hart last stopped on
+EXPORT int get_hit_breakpoint(void* sim, int hartid, uint64_t* address) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    *address = real_sim->harts[hartid].hit_breakpoint;
+    return SP_ERR_OK;
+}
+
+// =====================================
+//          INSTRUCTION TRACE
+// =====================================
+
+/* Starts tracing the instructions run by a hart to a new file at path
+   (replacing a trace in progress). Traced runs step one instruction at a
+   time and bypass the native tier.
+*/
+EXPORT int spike_trace_start(void* sim, int hartid, const char* path) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    hart_context& hart = real_sim->harts[hartid];
+    hart.tracer.reset();
+    hart.tracer.reset(trace_writer_t::create(path));
+    return hart.tracer ? SP_ERR_OK : SP_ERR_UNKNOWN;
+}
+
+// Drains the trace of a hart to its file and closes it
+EXPORT int spike_trace_stop(void* sim, int hartid) {
+    spikelib_sim_t* real_sim = get_spikelib_sim(sim);
+    if (real_sim == NULL) {
+        return SP_ERR_INVALID_SIMULATOR;
+    }
+    if (hartid < 0 || (size_t) hartid >= real_sim->nprocs()) {
+        return SP_ERR_HARTID_INVALID;
+    }
+    hart_context& hart = real_sim->harts[hartid];
+    if (!hart.tracer) {
+        return SP_ERR_OK;
+    }
+    bool written = hart.tracer->finish();
+    hart.tracer.reset();
+    return written ? SP_ERR_OK : SP_ERR_UNKNOWN;
+}
+
+// =====================================
+//              BATCH RUNS
+// =====================================
+
+// Runs one batch job on a pooled simulator
+static void run_batch_job(spike_batch_job* job, spike_batch_result* result) {
+    const char* isa = (job->isa != NULL) ? job->isa : DEFAULT_ISA;
+    void* sim = acquire_sim(job->memories, job->regions_number, isa);
+    if (sim == NULL) {
+        result->result = SP_ERR_INVALID_SIMULATOR;
+        return;
+    }
+    result->result = write_registers(sim, &job->registers);
+    if (result->result == SP_ERR_OK) {
+        result->result = spike_start(sim, job->begin_address, job->end_address, job->timeout, job->max_instruction_number);
+    }
+    result->registers.version = SPIKE_REGISTER_FILE_VERSION;
+    result->registers.banks   = SPIKE_REGS_ALL;
+    read_registers(sim, &result->registers);
+    recycle_sim(sim);
+}
+
+/* Run independent jobs on a pool of host threads (threads_number, or one per
+   host core when 0). Each job runs on its own simulator, recycled through the
+   simulator pool, and results[i] receives the code and final registers of
+   jobs[i]. Idle threads pick the next pending job, so long and short jobs
+   balance across threads. Simulators do not share mutable state once built
+   (softfloat's state is thread-local); their construction is serialized.
+*/
+EXPORT int spike_run_batch(void* jobs, int jobs_number, void* results, int threads_number) {
+    spike_batch_job* real_jobs = (spike_batch_job*) jobs;
+    spike_batch_result* real_results = (spike_batch_result*) results;
+    if (jobs_number <= 0) {
+        return SP_ERR_OK;
+    }
+    if (threads_number <= 0) {
+        threads_number = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads_number = std::min(threads_number, jobs_number);
+    std::atomic<int> next_job(0);
+    auto worker = [&]() {
+        for (int i = next_job++; i < jobs_number; i = next_job++) {
+            run_batch_job(&real_jobs[i], &real_results[i]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threads_number; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return SP_ERR_OK;
+}
 
 // =====================================
 //       MAIN FOR EXPERIMENTATIONS
@@ -11,19 +11,222 @@
 typedef struct {
     uint64_t base;
     uint64_t size;
-    void* content;
+    void* content;      // NULL for a sparse region, backed by the library and committed on first touch
 } memory_region;
 
+// Page permissions (mem_map, mem_protect)
+typedef enum {
+    SPIKE_PROT_NONE  = 0,
+    SPIKE_PROT_READ  = 1 << 0,
+    SPIKE_PROT_WRITE = 1 << 1,
+    SPIKE_PROT_EXEC  = 1 << 2,
+    SPIKE_PROT_ALL   = SPIKE_PROT_READ | SPIKE_PROT_WRITE | SPIKE_PROT_EXEC
+} spike_prot;
+
+// =====================================
+//        REGISTER FILE LAYOUT
+// =====================================
+
+#define SPIKE_REGISTER_FILE_VERSION 1
+
+// Register banks selected in spike_register_file.banks
+typedef enum {
+    SPIKE_REGS_XPR = 1 << 0,  // X0-X31
+    SPIKE_REGS_PC  = 1 << 1,  // PC
+    SPIKE_REGS_FPR = 1 << 2,  // F0-F31
+    SPIKE_REGS_ALL = SPIKE_REGS_XPR | SPIKE_REGS_PC | SPIKE_REGS_FPR
+} spike_register_bank;
+
+typedef struct {
+    uint32_t version;      // Must be SPIKE_REGISTER_FILE_VERSION
+    uint32_t banks;        // Mask of spike_register_bank to copy
+    uint64_t xpr[32];      // General registers
+    uint64_t pc;           // Program counter
+    uint64_t fpr[32][2];   // Floating point registers (128 bits, low word first)
+} spike_register_file;
+
+// =====================================
+//          BATCH RUN LAYOUT
+// =====================================
+
+// Independent run executed by spike_run_batch
+typedef struct {
+    memory_region* memories;          // Memory image, used in place by the run
+    int regions_number;
+    const char* isa;                  // NULL for the default ISA
+    spike_register_file registers;    // Initial registers (only the selected banks are written)
+    uint64_t begin_address;
+    uint64_t end_address;
+    uint64_t timeout;
+    uint64_t max_instruction_number;
+} spike_batch_job;
+
+typedef struct {
+    int result;                       // Code returned by the run (sp_err)
+    spike_register_file registers;    // Final registers (all banks)
+} spike_batch_result;
+
+// =====================================
+//        EXECUTION PROFILE LAYOUT
+// =====================================
+
+// Instructions retired at a pc (spike_profile_top)
+typedef struct {
+    uint64_t pc;
+    uint64_t count;
+} spike_profile_pc;
+
+// Taken branch or jump from one pc to another
+typedef struct {
+    uint64_t from;
+    uint64_t to;
+    uint64_t count;
+} spike_profile_edge;
+
+// =====================================
+//        INSTRUCTION TRACE FORMAT
+// =====================================
+
+/* A trace file (spike_trace_start) is a spike_trace_header followed by
+   records_number spike_trace_record, in execution order, little endian.
+*/
+#define SPIKE_TRACE_MAGIC   "SPKTRACE"
+#define SPIKE_TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];             // SPIKE_TRACE_MAGIC, not NUL-terminated
+    uint32_t version;          // SPIKE_TRACE_VERSION
+    uint32_t record_size;      // sizeof(spike_trace_record)
+    uint64_t records_number;
+    uint64_t reserved;
+} spike_trace_header;
+
+// Flags of a trace record
+typedef enum {
+    SPIKE_TRACE_MEM  = 1 << 0, // mem_address holds the address accessed
+    SPIKE_TRACE_TRAP = 1 << 1  // The instruction trapped (and did not retire)
+} spike_trace_flag;
+
+typedef struct {
+    uint64_t pc;
+    uint64_t rd_value;         // Value of the destination register field after the instruction
+    uint64_t mem_address;      // Effective address of a load, store or atomic
+    uint32_t bits;             // Instruction bits (16 low bits for compressed ones)
+    uint8_t rd;                // Destination register field
+    uint8_t flags;             // Mask of spike_trace_flag
+    uint16_t reserved;
+} spike_trace_record;
+
+// =====================================
+//            WATCHPOINTS
+// =====================================
+
+// Accesses stopping a run on a watched range (add_watchpoint)
+typedef enum {
+    SPIKE_WATCH_READ   = 1 << 0,
+    SPIKE_WATCH_WRITE  = 1 << 1,
+    SPIKE_WATCH_ACCESS = SPIKE_WATCH_READ | SPIKE_WATCH_WRITE
+} spike_watch_kind;
+
+// =====================================
+//               HOOKS
+// =====================================
+
+// Hook types (hook_add)
+typedef enum {
+    SPIKE_HOOK_CODE        = 1 << 0, // Before each instruction in the range
+    SPIKE_HOOK_MEM_READ    = 1 << 1, // After each guest load in the range
+    SPIKE_HOOK_MEM_WRITE   = 1 << 2, // After each guest store in the range
+    SPIKE_HOOK_MEM_INVALID = 1 << 3, // Unmapped or protected access in the range
+    SPIKE_HOOK_INTR        = 1 << 4  // Exception or interrupt taken (range ignored)
+} spike_hook_type;
+
+// size is 0 if the instruction cannot be fetched
+typedef void (*spike_hook_code_cb)(void* sim, uint64_t address, uint32_t size, void* user_data);
+// type is SPIKE_HOOK_MEM_READ or SPIKE_HOOK_MEM_WRITE, value holds the (first 8) bytes accessed
+typedef void (*spike_hook_mem_cb)(void* sim, int type, uint64_t address, int size, uint64_t value, void* user_data);
+// error is the sp_err of the access; return non-zero to run the instruction again (after fixing the access).
+// After 16 retries in a row of the same access the run stops with error
+typedef int (*spike_hook_mem_invalid_cb)(void* sim, int error, uint64_t address, void* user_data);
+// cause is the value of mcause (scause for a trap delegated to supervisor mode)
+typedef void (*spike_hook_intr_cb)(void* sim, uint64_t cause, void* user_data);
+
+// =====================================
+//          NATIVE TRANSLATION
+// =====================================
+
+// Modes of the native translation tier (spike_set_jit)
+typedef enum {
+    SPIKE_JIT_OFF = 0,        // Spike interprets everything
+    SPIKE_JIT_ON,             // Hot RV64IM blocks run as x86-64 host code
+    SPIKE_JIT_DIFFERENTIAL    // Translations are checked against Spike, which stays authoritative
+} spike_jit_mode;
+
 extern "C" {
     EXPORT void* initialize_sim_with_isa(memory_region* memories, int regions_number, const char* isa); // IMAFD
     EXPORT void* initialize_sim(memory_region* memories, int regions_number);
+    EXPORT void* initialize_sim_with_harts(memory_region* memories, int regions_number, const char* isa, int harts_number);
     EXPORT int read_register(void* sim, int regid, void* value);
     EXPORT int write_register(void* sim, int regid, void* value);
+    EXPORT int read_registers(void* sim, void* registers);
+    EXPORT int write_registers(void* sim, void* registers);
+    EXPORT int read_register_hart(void* sim, int hartid, int regid, void* value);
+    EXPORT int write_register_hart(void* sim, int hartid, int regid, void* value);
+    EXPORT int read_registers_hart(void* sim, int hartid, void* registers);
+    EXPORT int write_registers_hart(void* sim, int hartid, void* registers);
     EXPORT const char* sp_strerror(int code);
     EXPORT int write_memory(void* sim, uint64_t address, uint64_t size, void* value);
     EXPORT int read_memory(void* sim, uint64_t address, uint64_t size, void* value);
+    EXPORT int mem_map(void* sim, uint64_t address, uint64_t size, int perms);
+    EXPORT int mem_unmap(void* sim, uint64_t address, uint64_t size);
+    EXPORT int mem_protect(void* sim, uint64_t address, uint64_t size, int perms);
+    EXPORT int mem_resident_size(void* sim, uint64_t* resident, uint64_t* reserved);
+    EXPORT int get_dirty_pages(void* sim, uint64_t* pages, uint64_t* pages_number);
+    EXPORT int clear_dirty_pages(void* sim);
+    EXPORT void* mem_map_file(const char* path, uint64_t offset, uint64_t* size, int shared);
+    EXPORT int mem_unmap_file(void* content, uint64_t size);
+    EXPORT int load_elf(void* sim, const char* path);
+    EXPORT int get_symbol_address(void* sim, const char* name, uint64_t* address);
+    EXPORT int get_address_symbol(void* sim, uint64_t address, const char** name, uint64_t* offset);
     EXPORT int spike_start(void* sim, uint64_t begin_address, uint64_t end_address, uint64_t timeout, size_t max_instruction_number);
+    EXPORT int spike_start_hart(void* sim, int hartid, uint64_t begin_address, uint64_t end_address, uint64_t timeout, size_t max_instruction_number);
+    EXPORT int spike_start_harts(void* sim, int harts_number, uint64_t* begin_addresses, uint64_t* end_addresses, uint64_t timeout, size_t max_instruction_number, int* results, size_t lockstep_quantum);
+    EXPORT int spike_resume(void* sim, size_t budget);
+    EXPORT int spike_resume_hart(void* sim, int hartid, size_t budget);
+    EXPORT int spike_run_stats(void* sim, int hartid, uint64_t* instructions, uint64_t* elapsed_us);
+    EXPORT int spike_start_async(void* sim, uint64_t begin_address, uint64_t end_address, uint64_t timeout, size_t max_instruction_number);
+    EXPORT int spike_poll(void* sim, int* finished, int* result);
+    EXPORT int spike_wait(void* sim);
+    EXPORT int spike_stop(void* sim);
+    EXPORT int spike_run_batch(void* jobs, int jobs_number, void* results, int threads_number);
     EXPORT void release_sim(void* sim);
+    EXPORT void* acquire_sim(memory_region* memories, int regions_number, const char* isa);
+    EXPORT void recycle_sim(void* sim);
+    EXPORT void sim_pool_stats(uint64_t* hits, uint64_t* misses);
+    EXPORT void drain_sim_pool();
+    EXPORT void* sim_snapshot(void* sim);
+    EXPORT int sim_restore(void* sim, void* snapshot);
+    EXPORT void release_snapshot(void* snapshot);
+    EXPORT int spike_set_jit(void* sim, int mode);
+    EXPORT int spike_jit_stats(void* sim, uint64_t* translations, uint64_t* native_runs, uint64_t* mismatches);
+    EXPORT int spike_profile_enable(void* sim, int enabled);
+    EXPORT int spike_profile_reset(void* sim);
+    EXPORT int spike_profile_top(void* sim, void* pcs, uint64_t* pcs_number, void* edges, uint64_t* edges_number);
+    EXPORT int spike_profile_dump(void* sim, const char* path);
+    EXPORT int spike_trace_start(void* sim, int hartid, const char* path);
+    EXPORT int spike_trace_stop(void* sim, int hartid);
+    // Watchpoints and hooks are shared by the harts: change them only while no hart runs
+    EXPORT int add_watchpoint(void* sim, uint64_t address, uint64_t size, int kind);
+    EXPORT int remove_watchpoint(void* sim, uint64_t address, uint64_t size, int kind);
+    EXPORT int get_hit_watchpoint(void* sim, int hartid, uint64_t* address, int* kind);
+    EXPORT int add_breakpoint(void* sim, uint64_t address);
+    EXPORT int remove_breakpoint(void* sim, uint64_t address);
+    EXPORT int clear_breakpoints(void* sim);
+    EXPORT int get_hit_breakpoint(void* sim, int hartid, uint64_t* address);
+    // Harts started concurrently (spike_start_harts with lockstep_quantum 0) call the callbacks
+    // from their own host threads at the same time, so callbacks must then be thread-safe
+    EXPORT int hook_add(void* sim, uint64_t* hook_id, int type, void* callback, void* user_data, uint64_t begin, uint64_t end);
+    EXPORT int hook_del(void* sim, uint64_t hook_id);
 }
 
 // =====================================
@@ -129,6 +332,11 @@ typedef enum {
     SP_ERR_INSN_INVALID,      // Invalid Instruction
     SP_ERR_MAP_INVALID,       // Invalid memory mapping
     SP_ERR_INVALID_SIMULATOR, // Invalid or uninitialized simulator
-    SP_ERR_UNKNOWN            // Other error
+    SP_ERR_UNKNOWN,           // Other error
+    SP_ERR_HARTID_INVALID,    // Invalid hart id
+    SP_ERR_WATCHPOINT,        // Watched memory accessed
+    SP_ERR_BREAKPOINT,        // Breakpoint reached
+    SP_ERR_ELF_INVALID,       // Invalid or unsupported ELF file
+    SP_ERR_STOPPED            // Run stopped by spike_stop
 } sp_err;
 
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "mmu.h"
 #include "sim.h"
 #include "spikelib.h"
@@ -238,6 +239,68 @@ void test_mem_read_write_18_bytes() {
     release_sim(sim);
 }
 
+void test_mem_read_write_whole_region() {
+    void* sim = setup_simulation();
+    uint8_t mem_write_buffer[4096];
+    uint8_t mem_load_buffer[4096];
+    for (int i = 0; i < 4096; i++) {
+        mem_write_buffer[i] = (uint8_t) i;
+        mem_load_buffer[i]  = 0;
+    }
+    write_memory(sim, 0x1000, 4096, (void*) mem_write_buffer);
+    read_memory(sim, 0x1000, 4096, (void*) mem_load_buffer);
+    ASSERT_EQUALS_BYTE_ARRAY(mem_load_buffer, mem_write_buffer, 4096);
+    // The guest sees the same bytes
+    sim_t* real_sim = (sim_t*) sim;
+    ASSERT_EQUALS(real_sim->get_core(0)->get_mmu()->load_uint8(0x1fff), mem_write_buffer[4095]);
+    // Teardown
+    release_sim(sim);
+}
+
+// =====================================
+//          REGISTER FILE ACCESS
+// =====================================
+
+void test_write_read_register_file() {
+    void* sim = setup_simulation();
+    spike_register_file written;
+    spike_register_file loaded;
+    memset(&written, 0, sizeof(written));
+    memset(&loaded, 0, sizeof(loaded));
+    written.version = SPIKE_REGISTER_FILE_VERSION;
+    written.banks   = SPIKE_REGS_ALL;
+    for (int i = 0; i < 32; i++) {
+        written.xpr[i]    = 0x1000 + i;
+        written.fpr[i][0] = 0x2000 + i;
+    }
+    written.pc = 0x1008;
+    write_registers(sim, &written);
+    // X0 stays hardwired to zero
+    written.xpr[0] = 0;
+    loaded.version = SPIKE_REGISTER_FILE_VERSION;
+    loaded.banks   = SPIKE_REGS_ALL;
+    int res = read_registers(sim, &loaded);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    ASSERT_EQUALS_BYTE_ARRAY(loaded.xpr, written.xpr, sizeof(written.xpr));
+    ASSERT_EQUALS_BYTE_ARRAY(loaded.fpr, written.fpr, sizeof(written.fpr));
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X5, 0x1005);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1008);
+    // Teardown
+    release_sim(sim);
+}
+
+void test_register_file_wrong_version() {
+    void* sim = setup_simulation();
+    spike_register_file loaded;
+    memset(&loaded, 0, sizeof(loaded));
+    loaded.version = SPIKE_REGISTER_FILE_VERSION + 1;
+    loaded.banks   = SPIKE_REGS_XPR;
+    int res = read_registers(sim, &loaded);
+    ASSERT_EQUALS(res, SP_ERR_REGID_INVALID);
+    // Teardown
+    release_sim(sim);
+}
+
 // =====================================
 //             EXECUTION
 // =====================================
@@ -351,6 +414,1099 @@ void test_exec_jump_instruction_instruction_number() {
     release_sim(sim);
 }
 
+void test_exec_loop_instruction_number_across_batches() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0x13, 0x03, 0x13, 0x00, // addi x6 x6 1
+        0x6f, 0xf0, 0xdf, 0xff  // j    0x1000
+    };
+    uint64_t x6_value = 0x00000000;
+    write_register(sim, SPIKE_RISCV_REG_X6, &x6_value);
+    // Write instructions to memory
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    // Execute more instructions than a single batch holds
+    int res = spike_start(sim, 0x1000, 0x1200, 0, 1001);
+    // Verify return values
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 501);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1004);
+    ASSERT_EQUALS(res, SP_ERR_MAX_COUNT);
+    // Teardown
+    release_sim(sim);
+}
+
+void test_exec_instruction_number_with_minstret_write() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0x73, 0x10, 0x20, 0xb0, // csrw minstret x0
+        0x13, 0x03, 0x13, 0x00, // addi x6 x6 1
+        0x6f, 0xf0, 0x9f, 0xff  // j    0x1000
+    };
+    uint64_t x6_value = 0x00000000;
+    write_register(sim, SPIKE_RISCV_REG_X6, &x6_value);
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    // Resetting minstret must not hide the instruction budget
+    int res = spike_start(sim, 0x1000, 0x1200, 0, 300);
+    ASSERT_EQUALS(res, SP_ERR_MAX_COUNT);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 100);
+    // Teardown
+    release_sim(sim);
+}
+
+void test_exec_sees_write_to_instruction_across_pages() {
+    void* content = calloc(1, 8192);
+    memory_region region[] = { {.base = 0x1000, .size = 8192, .content = content} };
+    void* sim = initialize_sim(region, 1);
+    // The second half of the instruction is on the next page
+    uint8_t instruction[] {
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    uint64_t x6_value = 0x00000000;
+    write_register(sim, SPIKE_RISCV_REG_X6, &x6_value);
+    write_memory(sim, 0x1ffe, sizeof(instruction), instruction);
+    ASSERT_EQUALS(spike_start(sim, 0x1ffe, 0x2002, 0, 0), SP_ERR_OK);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 1);
+    // Only rewrite the half on the second page, to addi x6 x6 2
+    uint8_t upper_half[] { 0x23, 0x00 };
+    write_memory(sim, 0x2000, sizeof(upper_half), upper_half);
+    ASSERT_EQUALS(spike_start(sim, 0x1ffe, 0x2002, 0, 0), SP_ERR_OK);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 3);
+    // Teardown
+    release_sim(sim);
+}
+
+// =====================================
+//              SNAPSHOTS
+// =====================================
+
+void test_snapshot_restore_memory_and_registers() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0xb7, 0x13, 0x00, 0x00, // lui x7, 0x1
+        0x23, 0xb0, 0x53, 0x10  // sd  x5, 256(x7)
+    };
+    uint64_t x5_value = 0x42;
+    uint64_t stored_value = 0;
+    write_register(sim, SPIKE_RISCV_REG_X5, &x5_value);
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    void* snapshot = sim_snapshot(sim);
+    // Run twice to check the stores are tracked again after a restore
+    for (int run = 0; run < 2; run++) {
+        int res = spike_start(sim, 0x1000, 0x1008, 0, 0);
+        ASSERT_EQUALS(res, SP_ERR_OK);
+        read_memory(sim, 0x1100, 8, &stored_value);
+        ASSERT_EQUALS(stored_value, 0x42);
+        ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X7, 0x1000);
+        // Restore and verify the state from before the run
+        ASSERT_EQUALS(sim_restore(sim, snapshot), SP_ERR_OK);
+        read_memory(sim, 0x1100, 8, &stored_value);
+        ASSERT_EQUALS(stored_value, 0);
+        ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X7, 0);
+        ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X5, 0x42);
+    }
+    // Teardown
+    release_snapshot(snapshot);
+    release_sim(sim);
+}
+
+void test_restore_between_two_snapshots() {
+    void* sim = setup_simulation();
+    uint64_t value = 1;
+    write_memory(sim, 0x1100, 8, &value);
+    void* first = sim_snapshot(sim);
+    value = 2;
+    write_memory(sim, 0x1100, 8, &value);
+    void* second = sim_snapshot(sim);
+    value = 3;
+    write_memory(sim, 0x1100, 8, &value);
+    // Each restore must see the pages the previous one copied back
+    ASSERT_EQUALS(sim_restore(sim, first), SP_ERR_OK);
+    read_memory(sim, 0x1100, 8, &value);
+    ASSERT_EQUALS(value, 1);
+    ASSERT_EQUALS(sim_restore(sim, second), SP_ERR_OK);
+    read_memory(sim, 0x1100, 8, &value);
+    ASSERT_EQUALS(value, 2);
+    ASSERT_EQUALS(sim_restore(sim, first), SP_ERR_OK);
+    read_memory(sim, 0x1100, 8, &value);
+    ASSERT_EQUALS(value, 1);
+    // Teardown
+    release_snapshot(first);
+    release_snapshot(second);
+    release_sim(sim);
+}
+
+void test_snapshot_sparse_region() {
+    memory_region regions[] = {
+        {.base = 0x80000000, .size = 1 << 30, .content = NULL}
+    };
+    void* sim = initialize_sim(regions, 1);
+    uint64_t value = 0x1234;
+    write_memory(sim, 0x80100000, 8, &value);
+    uint64_t resident, reserved, snapshot_resident;
+    ASSERT_EQUALS(mem_resident_size(sim, &resident, &reserved), SP_ERR_OK);
+    // Untouched pages are neither saved nor committed
+    void* snapshot = sim_snapshot(sim);
+    ASSERT_EQUALS(mem_resident_size(sim, &snapshot_resident, &reserved), SP_ERR_OK);
+    ASSERT_EQUALS(snapshot_resident, resident);
+    value = 0x5678;
+    write_memory(sim, 0x80100000, 8, &value);
+    write_memory(sim, 0x80300000, 8, &value);
+    // Pages that were zero are dropped again by the restore
+    ASSERT_EQUALS(sim_restore(sim, snapshot), SP_ERR_OK);
+    read_memory(sim, 0x80100000, 8, &value);
+    ASSERT_EQUALS(value, 0x1234);
+    read_memory(sim, 0x80300000, 8, &value);
+    ASSERT_EQUALS(value, 0);
+    ASSERT_EQUALS(mem_resident_size(sim, &snapshot_resident, &reserved), SP_ERR_OK);
+    ASSERT_EQUALS(snapshot_resident, resident);
+    // Teardown
+    release_snapshot(snapshot);
+    release_sim(sim);
+}
+
+// =====================================
+//            SIMULATOR POOL
+// =====================================
+
+void test_pool_recycles_clean_simulator() {
+    void* first_content  = calloc(1, 4096);
+    void* second_content = calloc(1, 4096);
+    memory_region first_region[]  = { {.base = 0x1000, .size = 4096, .content = first_content} };
+    memory_region second_region[] = { {.base = 0x1000, .size = 4096, .content = second_content} };
+    uint64_t hits_before, misses_before, hits, misses;
+    sim_pool_stats(&hits_before, &misses_before);
+    // Dirty a first simulator and give it back
+    void* sim = acquire_sim(first_region, 1, "RV64IMAFDC");
+    uint64_t x5_value = 0x1234;
+    write_register(sim, SPIKE_RISCV_REG_X5, &x5_value);
+    recycle_sim(sim);
+    // The next acquire with the same layout reuses it, clean and bound to the new buffer
+    void* recycled = acquire_sim(second_region, 1, "RV64IMAFDC");
+    sim_pool_stats(&hits, &misses);
+    ASSERT_EQUALS(hits - hits_before, 1);
+    ASSERT_EQUALS(misses - misses_before, 1);
+    ASSERT_EQUALS_REGISTER(recycled, SPIKE_RISCV_REG_X5, 0);
+    uint32_t instr_add = 0x007302B3;
+    write_memory(recycled, 0x1000, 4, &instr_add);
+    ASSERT_EQUALS(*((uint32_t*) second_content), instr_add);
+    ASSERT_EQUALS(*((uint32_t*) first_content), 0);
+    // Teardown
+    recycle_sim(recycled);
+    drain_sim_pool();
+    free(first_content);
+    free(second_content);
+}
+
+void test_pool_recycles_stopped_simulator() {
+    void* content = calloc(1, 4096);
+    memory_region region[] = { {.base = 0x1000, .size = 4096, .content = content} };
+    uint8_t instructions[] {
+        0x05, 0x03,             // addi x6 x6 1
+        0xfd, 0xbf              // j    0x1000
+    };
+    uint8_t store[] {
+        0xb7, 0x13, 0x00, 0x00, // lui x7 0x1
+        0x23, 0xb0, 0x63, 0x10  // sd  x6 0x100(x7)
+    };
+    // Leave a watchpoint hit, a breakpoint hit and a stopped run behind
+    void* sim = acquire_sim(region, 1, "RV64IMAFDC");
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    write_memory(sim, 0x1010, sizeof(store), store);
+    ASSERT_EQUALS(add_watchpoint(sim, 0x1100, 8, SPIKE_WATCH_WRITE), SP_ERR_OK);
+    ASSERT_EQUALS(spike_start(sim, 0x1010, 0x1200, 0, 0), SP_ERR_WATCHPOINT);
+    ASSERT_EQUALS(remove_watchpoint(sim, 0x1100, 8, SPIKE_WATCH_WRITE), SP_ERR_OK);
+    ASSERT_EQUALS(add_breakpoint(sim, 0x1002), SP_ERR_OK);
+    ASSERT_EQUALS(spike_start(sim, 0x1000, 0x1200, 0, 0), SP_ERR_BREAKPOINT);
+    ASSERT_EQUALS(remove_breakpoint(sim, 0x1002), SP_ERR_OK);
+    ASSERT_EQUALS(spike_start_async(sim, 0x1000, 0x1200, 0, 0), SP_ERR_OK);
+    usleep(10000);
+    ASSERT_EQUALS(spike_stop(sim), SP_ERR_OK);
+    ASSERT_EQUALS(spike_wait(sim), SP_ERR_STOPPED);
+    recycle_sim(sim);
+    // The recycled simulator carries none of it
+    void* recycled = acquire_sim(region, 1, "RV64IMAFDC");
+    ASSERT_EQUALS(recycled, sim);
+    uint64_t address = 1;
+    ASSERT_EQUALS(get_hit_breakpoint(recycled, 0, &address), SP_ERR_OK);
+    ASSERT_EQUALS(address, 0);
+    int kind = 1;
+    ASSERT_EQUALS(get_hit_watchpoint(recycled, 0, &address, &kind), SP_ERR_OK);
+    ASSERT_EQUALS(address, 0);
+    ASSERT_EQUALS(kind, 0);
+    write_memory(recycled, 0x1000, sizeof(instructions), instructions);
+    ASSERT_EQUALS(spike_start_async(recycled, 0x1000, 0x1200, 0, 10), SP_ERR_OK);
+    ASSERT_EQUALS(spike_wait(recycled), SP_ERR_MAX_COUNT);
+    // Teardown
+    recycle_sim(recycled);
+    drain_sim_pool();
+    free(content);
+}
+
+// =====================================
+//              MULTI-HART
+// =====================================
+
+void test_multi_hart_run(size_t lockstep_quantum) {
+    void* content = calloc(1, 4096);
+    memory_region region[] = { {.base = 0x1000, .size = 4096, .content = content} };
+    void* sim = initialize_sim_with_harts(region, 1, "RV64IMAFDC", 2);
+    uint8_t instructions[] {
+        0x13, 0x03, 0x13, 0x00, // addi x6 x6 1
+        0x6f, 0xf0, 0xdf, 0xff  // j    0x1000
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    uint64_t x6_value = 100;
+    write_register_hart(sim, 1, SPIKE_RISCV_REG_X6, &x6_value);
+    // Both harts run the same loop on their own registers
+    uint64_t begin_addresses[] = {0x1000, 0x1000};
+    uint64_t end_addresses[]   = {0x1200, 0x1200};
+    int results[] = {SP_ERR_UNKNOWN, SP_ERR_UNKNOWN};
+    spike_start_harts(sim, 2, begin_addresses, end_addresses, 0, 11, results, lockstep_quantum);
+    ASSERT_EQUALS(results[0], SP_ERR_MAX_COUNT);
+    ASSERT_EQUALS(results[1], SP_ERR_MAX_COUNT);
+    read_register_hart(sim, 0, SPIKE_RISCV_REG_X6, &test_register);
+    ASSERT_EQUALS(test_register, 6);
+    read_register_hart(sim, 1, SPIKE_RISCV_REG_X6, &test_register);
+    ASSERT_EQUALS(test_register, 106);
+    // Teardown
+    release_sim(sim);
+    free(content);
+}
+
+void test_multi_hart_concurrent() {
+    test_multi_hart_run(0);
+}
+
+void test_multi_hart_lockstep() {
+    test_multi_hart_run(3);
+}
+
+void test_multi_hart_lockstep_lr_sc() {
+    void* content = calloc(1, 4096);
+    memory_region region[] = { {.base = 0x1000, .size = 4096, .content = content} };
+    void* sim = initialize_sim_with_harts(region, 1, "RV64IMAFDC", 2);
+    uint8_t instructions[] {
+        0xb7, 0x13, 0x00, 0x00, // lui  x7 0x1
+        0x93, 0x83, 0x03, 0x10, // addi x7 x7 256
+        0xaf, 0xb2, 0x03, 0x10, // lr.d x5 (x7)
+        0x93, 0x82, 0x12, 0x00, // addi x5 x5 1
+        0x2f, 0xbe, 0x53, 0x18, // sc.d x28 x5 (x7)
+        0xe3, 0x1a, 0x0e, 0xfe, // bnez x28 0x1008
+        0x13, 0x03, 0xf3, 0xff, // addi x6 x6 -1
+        0xe3, 0x16, 0x03, 0xfe  // bnez x6 0x1008
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    uint64_t x6_value = 50;
+    write_register_hart(sim, 0, SPIKE_RISCV_REG_X6, &x6_value);
+    write_register_hart(sim, 1, SPIKE_RISCV_REG_X6, &x6_value);
+    // Both harts increment the same counter, quanta end between lr and sc
+    uint64_t begin_addresses[] = {0x1000, 0x1000};
+    uint64_t end_addresses[]   = {0x1020, 0x1020};
+    int results[] = {SP_ERR_UNKNOWN, SP_ERR_UNKNOWN};
+    spike_start_harts(sim, 2, begin_addresses, end_addresses, 0, 0, results, 16);
+    ASSERT_EQUALS(results[0], SP_ERR_OK);
+    ASSERT_EQUALS(results[1], SP_ERR_OK);
+    uint64_t counter = 0;
+    read_memory(sim, 0x1100, 8, &counter);
+    ASSERT_EQUALS(counter, 100);
+    // Teardown
+    release_sim(sim);
+    free(content);
+}
+
+void test_invalid_hart_id() {
+    void* sim = setup_simulation();
+    int res = read_register_hart(sim, 1, SPIKE_RISCV_REG_X5, &test_register);
+    ASSERT_EQUALS(res, SP_ERR_HARTID_INVALID);
+    // Teardown
+    release_sim(sim);
+}
+
+// =====================================
+//             RESUMED RUNS
+// =====================================
+
+void test_resume_runs_in_slices() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0x05, 0x03,             // addi x6 x6 1
+        0xfd, 0xbf              // j    0x1000
+    };
+    uint64_t x6_value = 0x00000000;
+    write_register(sim, SPIKE_RISCV_REG_X6, &x6_value);
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    // First slice, then slices continuing from the current pc
+    ASSERT_EQUALS(spike_start(sim, 0x1000, 0x1200, 0, 10), SP_ERR_MAX_COUNT);
+    for (int i = 0; i < 4; i++) {
+        ASSERT_EQUALS(spike_resume(sim, 10), SP_ERR_MAX_COUNT);
+    }
+    // Each addi is one of two instructions of the loop
+    read_register(sim, SPIKE_RISCV_REG_X6, &x6_value);
+    ASSERT_EQUALS(x6_value, 25);
+    uint64_t count = 0;
+    uint64_t elapsed_us = 0;
+    ASSERT_EQUALS(spike_run_stats(sim, 0, &count, &elapsed_us), SP_ERR_OK);
+    ASSERT_EQUALS(count, 50);
+    // A new start restarts the accounting
+    ASSERT_EQUALS(spike_start(sim, 0x1000, 0x1200, 0, 4), SP_ERR_MAX_COUNT);
+    ASSERT_EQUALS(spike_run_stats(sim, 0, &count, &elapsed_us), SP_ERR_OK);
+    ASSERT_EQUALS(count, 4);
+    ASSERT_EQUALS(spike_run_stats(sim, 1, &count, &elapsed_us), SP_ERR_HARTID_INVALID);
+    // Teardown
+    release_sim(sim);
+}
+
+// =====================================
+//            ASYNCHRONOUS RUNS
+// =====================================
+
+void test_async_run_stops_on_request() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0x05, 0x03,             // addi x6 x6 1
+        0xfd, 0xbf              // j    0x1000
+    };
+    uint64_t x6_value = 0x00000000;
+    write_register(sim, SPIKE_RISCV_REG_X6, &x6_value);
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    // Nothing to poll or wait before a run
+    int finished = 0;
+    int result   = SP_ERR_OK;
+    ASSERT_EQUALS(spike_poll(sim, &finished, &result), SP_ERR_UNKNOWN);
+    // A stop requested while idle does not affect the next run
+    ASSERT_EQUALS(spike_stop(sim), SP_ERR_OK);
+    // The loop never ends on its own
+    ASSERT_EQUALS(spike_start_async(sim, 0x1000, 0x1200, 0, 0), SP_ERR_OK);
+    ASSERT_EQUALS(spike_start_async(sim, 0x1000, 0x1200, 0, 0), SP_ERR_UNKNOWN);
+    usleep(10000);
+    ASSERT_EQUALS(spike_poll(sim, &finished, &result), SP_ERR_OK);
+    ASSERT_EQUALS(finished, 0);
+    ASSERT_EQUALS(spike_stop(sim), SP_ERR_OK);
+    ASSERT_EQUALS(spike_wait(sim), SP_ERR_STOPPED);
+    ASSERT_EQUALS(spike_poll(sim, &finished, &result), SP_ERR_OK);
+    ASSERT_EQUALS(finished, 1);
+    ASSERT_EQUALS(result, SP_ERR_STOPPED);
+    // The result stays available until the next run
+    ASSERT_EQUALS(spike_wait(sim), SP_ERR_STOPPED);
+    // The hart stopped at a block boundary of the loop
+    uint64_t pc = 0;
+    read_register(sim, SPIKE_RISCV_REG_PC, &pc);
+    ASSERT_EQUALS((pc == 0x1000) || (pc == 0x1002), true);
+    read_register(sim, SPIKE_RISCV_REG_X6, &x6_value);
+    ASSERT_EQUALS((x6_value > 0), true);
+    // A run ending on its own, started after a finished one
+    ASSERT_EQUALS(spike_start_async(sim, 0x1000, 0x1200, 0, 10), SP_ERR_OK);
+    ASSERT_EQUALS(spike_wait(sim), SP_ERR_MAX_COUNT);
+    ASSERT_EQUALS(spike_poll(sim, &finished, &result), SP_ERR_OK);
+    ASSERT_EQUALS(finished, 1);
+    ASSERT_EQUALS(result, SP_ERR_MAX_COUNT);
+    // Releasing a running simulator stops it first
+    ASSERT_EQUALS(spike_start_async(sim, 0x1000, 0x1200, 0, 0), SP_ERR_OK);
+    release_sim(sim);
+}
+
+// =====================================
+//             BATCH RUNS
+// =====================================
+
+void test_batch_run_independent_jobs() {
+    const int jobs_number = 8;
+    uint8_t instructions[] {
+        0x13, 0x03, 0x13, 0x00, // addi x6 x6 1
+        0x6f, 0xf0, 0xdf, 0xff  // j    0x1000
+    };
+    memory_region regions[jobs_number];
+    spike_batch_job jobs[jobs_number];
+    spike_batch_result results[jobs_number];
+    memset(jobs, 0, sizeof(jobs));
+    for (int i = 0; i < jobs_number; i++) {
+        regions[i].base    = 0x1000;
+        regions[i].size    = 4096;
+        regions[i].content = calloc(1, 4096);
+        memcpy(regions[i].content, instructions, sizeof(instructions));
+        jobs[i].memories           = &regions[i];
+        jobs[i].regions_number     = 1;
+        jobs[i].registers.version  = SPIKE_REGISTER_FILE_VERSION;
+        jobs[i].registers.banks    = SPIKE_REGS_XPR;
+        jobs[i].registers.xpr[6]   = 1000 * i;
+        jobs[i].begin_address      = 0x1000;
+        jobs[i].end_address        = 0x1200;
+        jobs[i].max_instruction_number = 2 * i + 1;
+    }
+    spike_run_batch(jobs, jobs_number, results, 4);
+    for (int i = 0; i < jobs_number; i++) {
+        ASSERT_EQUALS(results[i].result, SP_ERR_MAX_COUNT);
+        ASSERT_EQUALS(results[i].registers.xpr[6], 1000 * i + i + 1);
+        ASSERT_EQUALS(results[i].registers.pc, 0x1004);
+    }
+    // Teardown
+    drain_sim_pool();
+    for (int i = 0; i < jobs_number; i++) {
+        free(regions[i].content);
+    }
+}
+
+void test_batch_run_floating_point_jobs() {
+    const int jobs_number = 8;
+    uint8_t instructions[] {
+        0xb7, 0x62, 0x00, 0x00, // lui      x5 0x6
+        0x73, 0xa0, 0x02, 0x30, // csrs     mstatus x5
+        0x73, 0x10, 0x25, 0x00, // fsrm     x10
+        0x53, 0xf0, 0x25, 0xd2, // fcvt.d.l f0 x11
+        0xd3, 0x70, 0x26, 0xd2, // fcvt.d.l f1 x12
+        0x53, 0x71, 0x10, 0x1a, // fdiv.d   f2 f0 f1
+        0xd3, 0x06, 0x01, 0xe2, // fmv.x.d  x13 f2
+        0x73, 0x27, 0x10, 0x00, // frflags  x14
+        0x63, 0x94, 0xf6, 0x00, // bne      x13 x15 0x1028
+        0x6f, 0xf0, 0x1f, 0xff, // j        0x1014
+        0x6f, 0x00, 0x00, 0x00  // j        0x1028
+    };
+    memory_region regions[jobs_number];
+    spike_batch_job jobs[jobs_number];
+    spike_batch_result results[jobs_number];
+    memset(jobs, 0, sizeof(jobs));
+    for (int i = 0; i < jobs_number; i++) {
+        regions[i].base    = 0x1000;
+        regions[i].size    = 4096;
+        regions[i].content = calloc(1, 4096);
+        memcpy(regions[i].content, instructions, sizeof(instructions));
+        jobs[i].memories           = &regions[i];
+        jobs[i].regions_number     = 1;
+        jobs[i].registers.version  = SPIKE_REGISTER_FILE_VERSION;
+        jobs[i].registers.banks    = SPIKE_REGS_XPR;
+        // Jobs alternate between rounding down and up, 1/3 differs in the last bit
+        jobs[i].registers.xpr[10]  = (i % 2 == 0) ? 2 : 3;
+        jobs[i].registers.xpr[11]  = 1;
+        jobs[i].registers.xpr[12]  = 3;
+        jobs[i].registers.xpr[15]  = (i % 2 == 0) ? 0x3fd5555555555555 : 0x3fd5555555555556;
+        jobs[i].begin_address      = 0x1000;
+        jobs[i].end_address        = 0x1200;
+        jobs[i].max_instruction_number = 100000;
+    }
+    spike_run_batch(jobs, jobs_number, results, 4);
+    // Every division was rounded with the job's own mode and raised inexact
+    for (int i = 0; i < jobs_number; i++) {
+        ASSERT_EQUALS(results[i].result, SP_ERR_MAX_COUNT);
+        ASSERT_EQUALS((results[i].registers.pc != 0x1028), true);
+        ASSERT_EQUALS(results[i].registers.xpr[13], jobs[i].registers.xpr[15]);
+        ASSERT_EQUALS(results[i].registers.xpr[14], 1);
+    }
+    // Teardown
+    drain_sim_pool();
+    for (int i = 0; i < jobs_number; i++) {
+        free(regions[i].content);
+    }
+}
+
+// =====================================
+//          NATIVE TRANSLATION
+// =====================================
+
+void test_jit_matches_interpreter(int mode) {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0x13, 0x03, 0x13, 0x00, // addi x6 x6 1
+        0xb3, 0x83, 0x63, 0x00, // add  x7 x7 x6
+        0x6f, 0xf0, 0x9f, 0xff  // j    0x1000
+    };
+    uint64_t zero = 0;
+    write_register(sim, SPIKE_RISCV_REG_X6, &zero);
+    write_register(sim, SPIKE_RISCV_REG_X7, &zero);
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    ASSERT_EQUALS(spike_set_jit(sim, mode), SP_ERR_OK);
+    // Long enough for the loop block to get hot
+    int res = spike_start(sim, 0x1000, 0x1200, 0, 30000);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 10000);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X7, 50005000);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1000);
+    ASSERT_EQUALS(res, SP_ERR_MAX_COUNT);
+    uint64_t translations, native_runs, mismatches;
+    spike_jit_stats(sim, &translations, &native_runs, &mismatches);
+    ASSERT_EQUALS(mismatches, 0);
+#if defined(__x86_64__)
+    ASSERT_EQUALS(native_runs > 0, true);
+#endif
+    // Teardown
+    release_sim(sim);
+}
+
+void test_jit() {
+    test_jit_matches_interpreter(SPIKE_JIT_ON);
+}
+
+void test_jit_differential() {
+    test_jit_matches_interpreter(SPIKE_JIT_DIFFERENTIAL);
+}
+
+// =====================================
+//          EXECUTION PROFILE
+// =====================================
+
+void test_profile_counts_pcs_and_edges() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0x13, 0x03, 0x13, 0x00, // addi x6 x6 1
+        0xb3, 0x83, 0x63, 0x00, // add  x7 x7 x6
+        0x6f, 0xf0, 0x9f, 0xff  // j    0x1000
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    spike_profile_pc pcs[4];
+    spike_profile_edge edges[4];
+    uint64_t pcs_number = 4;
+    uint64_t edges_number = 4;
+    // Runs are not profiled by default
+    spike_start(sim, 0x1000, 0x1200, 0, 300);
+    spike_profile_top(sim, pcs, &pcs_number, edges, &edges_number);
+    ASSERT_EQUALS(pcs_number, 0);
+    // 10000 iterations of the loop
+    spike_profile_enable(sim, 1);
+    spike_start(sim, 0x1000, 0x1200, 0, 30000);
+    pcs_number = 4;
+    edges_number = 4;
+    spike_profile_top(sim, pcs, &pcs_number, edges, &edges_number);
+    ASSERT_EQUALS(pcs_number, 3);
+    ASSERT_EQUALS(pcs[0].pc, 0x1000);
+    ASSERT_EQUALS(pcs[0].count, 10000);
+    ASSERT_EQUALS(pcs[2].pc, 0x1008);
+    ASSERT_EQUALS(pcs[2].count, 10000);
+    ASSERT_EQUALS(edges_number, 1);
+    ASSERT_EQUALS(edges[0].from, 0x1008);
+    ASSERT_EQUALS(edges[0].to, 0x1000);
+    ASSERT_EQUALS(edges[0].count, 10000);
+    // Teardown
+    release_sim(sim);
+}
+
+void test_profile_keeps_rewritten_code_visible() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    uint8_t second[] { 0x13, 0x03, 0x23, 0x00 }; // addi x6 x6 2
+    uint8_t third[]  { 0x13, 0x03, 0x33, 0x00 }; // addi x6 x6 3
+    uint64_t x6_value = 0;
+    write_register(sim, SPIKE_RISCV_REG_X6, &x6_value);
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    spike_profile_enable(sim, 1);
+    ASSERT_EQUALS(spike_start(sim, 0x1000, 0x1004, 0, 0), SP_ERR_OK);
+    // Exporting the profile decodes the rewritten instruction again
+    write_memory(sim, 0x1000, sizeof(second), second);
+    spike_profile_pc pcs[4];
+    spike_profile_edge edges[4];
+    uint64_t pcs_number = 4;
+    uint64_t edges_number = 4;
+    spike_profile_top(sim, pcs, &pcs_number, edges, &edges_number);
+    ASSERT_EQUALS(pcs_number, 1);
+    // A later rewrite is still seen by the next run
+    write_memory(sim, 0x1000, sizeof(third), third);
+    ASSERT_EQUALS(spike_start(sim, 0x1000, 0x1004, 0, 0), SP_ERR_OK);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 4);
+    // Teardown
+    release_sim(sim);
+}
+
+// =====================================
+//          INSTRUCTION TRACE
+// =====================================
+
+void test_trace_records_instructions() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0xb7, 0x13, 0x00, 0x00, // lui  x7, 0x1
+        0x23, 0xb0, 0x53, 0x10, // sd   x5, 256(x7)
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    const char* path = "spikelib-test.trace";
+    ASSERT_EQUALS(spike_trace_start(sim, 0, path), SP_ERR_OK);
+    int res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    ASSERT_EQUALS(spike_trace_stop(sim, 0), SP_ERR_OK);
+    // Read the trace back
+    spike_trace_header header;
+    spike_trace_record records[3];
+    FILE* file = fopen(path, "rb");
+    ASSERT_EQUALS(fread(&header, sizeof(header), 1, file), 1);
+    ASSERT_EQUALS(memcmp(header.magic, SPIKE_TRACE_MAGIC, sizeof(header.magic)), 0);
+    ASSERT_EQUALS(header.records_number, 3);
+    ASSERT_EQUALS(fread(records, sizeof(spike_trace_record), 3, file), 3);
+    fclose(file);
+    remove(path);
+    ASSERT_EQUALS(records[0].pc, 0x1000);
+    ASSERT_EQUALS(records[0].rd, 7);
+    ASSERT_EQUALS(records[0].rd_value, 0x1000);
+    ASSERT_EQUALS(records[1].bits, 0x1053b023);
+    ASSERT_EQUALS(records[1].flags, SPIKE_TRACE_MEM);
+    ASSERT_EQUALS(records[1].mem_address, 0x1100);
+    ASSERT_EQUALS(records[2].pc, 0x1008);
+    ASSERT_EQUALS(records[2].rd_value, 1);
+    // Teardown
+    release_sim(sim);
+}
+
+// =====================================
+//            MEMORY MAPPING
+// =====================================
+
+void test_mem_protect_and_unmap() {
+    void* content = calloc(1, 8192);
+    memory_region region[] = { {.base = 0x1000, .size = 8192, .content = content} };
+    void* sim = initialize_sim(region, 1);
+    uint8_t instructions[] {
+        0xb7, 0x23, 0x00, 0x00, // lui  x7, 0x2
+        0x23, 0xb0, 0x53, 0x00, // sd   x5, 0(x7)
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    uint64_t value;
+    // Write-protected data page
+    ASSERT_EQUALS(mem_protect(sim, 0x2000, 4096, SPIKE_PROT_READ), SP_ERR_OK);
+    int res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_WRITE_PROT);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1004);
+    ASSERT_EQUALS(read_memory(sim, 0x2000, 8, &value), SP_ERR_OK);
+    // Unmapped data page
+    ASSERT_EQUALS(mem_unmap(sim, 0x2000, 4096), SP_ERR_OK);
+    res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_WRITE_UNMAPPED);
+    ASSERT_EQUALS(read_memory(sim, 0x2000, 8, &value), SP_ERR_READ_UNMAPPED);
+    // Mapped back
+    ASSERT_EQUALS(mem_map(sim, 0x2000, 4096, SPIKE_PROT_READ | SPIKE_PROT_WRITE), SP_ERR_OK);
+    res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    // Non-executable code page
+    ASSERT_EQUALS(mem_protect(sim, 0x1000, 4096, SPIKE_PROT_READ | SPIKE_PROT_WRITE), SP_ERR_OK);
+    res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_FETCH_PROT);
+    // Invalid mappings: unaligned, outside the regions, already mapped
+    ASSERT_EQUALS(mem_protect(sim, 0x1800, 4096, SPIKE_PROT_ALL), SP_ERR_MAP_INVALID);
+    ASSERT_EQUALS(mem_map(sim, 0x4000, 4096, SPIKE_PROT_ALL), SP_ERR_MAP_INVALID);
+    ASSERT_EQUALS(mem_map(sim, 0x2000, 4096, SPIKE_PROT_ALL), SP_ERR_MAP_INVALID);
+    // Teardown
+    release_sim(sim);
+    free(content);
+}
+
+void test_sparse_region_commits_on_touch() {
+    void* content = calloc(1, 4096);
+    memory_region regions[] = {
+        {.base = 0x1000,     .size = 4096,    .content = content},
+        {.base = 0x80000000, .size = 1 << 30, .content = NULL}
+    };
+    void* sim = initialize_sim(regions, 2);
+    uint64_t resident, reserved;
+    ASSERT_EQUALS(mem_resident_size(sim, &resident, &reserved), SP_ERR_OK);
+    ASSERT_EQUALS(reserved, 1 << 30);
+    ASSERT_EQUALS(resident, 0);
+    // Only the touched page is committed
+    uint64_t value = 0x1234;
+    write_memory(sim, 0x80100000, 8, &value);
+    ASSERT_EQUALS(mem_resident_size(sim, &resident, &reserved), SP_ERR_OK);
+    ASSERT_EQUALS(resident, (uint64_t) sysconf(_SC_PAGESIZE));
+    // Untouched memory reads as zero
+    read_memory(sim, 0x80200000, 8, &value);
+    ASSERT_EQUALS(value, 0);
+    read_memory(sim, 0x80100000, 8, &value);
+    ASSERT_EQUALS(value, 0x1234);
+    // Teardown
+    release_sim(sim);
+    free(content);
+}
+
+void test_file_backed_region() {
+    uint8_t instructions[] {
+        0xb7, 0x13, 0x00, 0x00, // lui  x7, 0x1
+        0x23, 0xb0, 0x53, 0x10, // sd   x5, 256(x7)
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    char path[] = "/tmp/spikelib-test-XXXXXX";
+    int fd = mkstemp(path);
+    write(fd, instructions, sizeof(instructions));
+    close(fd);
+    // The region is larger than the file, the rest reads as zero
+    uint64_t size = 8192;
+    void* content = mem_map_file(path, 0, &size, 0);
+    ASSERT_EQUALS(content != NULL, true);
+    memory_region region[] = { {.base = 0x1000, .size = size, .content = content} };
+    void* sim = initialize_sim(region, 1);
+    uint64_t x5_value = 0x1234;
+    write_register(sim, SPIKE_RISCV_REG_X5, &x5_value);
+    int res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    uint64_t value;
+    read_memory(sim, 0x1100, 8, &value);
+    ASSERT_EQUALS(value, 0x1234);
+    read_memory(sim, 0x2000, 8, &value);
+    ASSERT_EQUALS(value, 0);
+    release_sim(sim);
+    ASSERT_EQUALS(mem_unmap_file(content, size), SP_ERR_OK);
+    // A private mapping leaves the file untouched
+    uint64_t file_size = 0;
+    content = mem_map_file(path, 0, &file_size, 0);
+    ASSERT_EQUALS(file_size, sizeof(instructions));
+    ASSERT_EQUALS_BYTE_ARRAY(content, instructions, sizeof(instructions));
+    // Teardown
+    mem_unmap_file(content, file_size);
+    unlink(path);
+}
+
+// =====================================
+//             DIRTY PAGES
+// =====================================
+
+void test_dirty_pages_track_guest_stores() {
+    void* content = calloc(1, 3 * 4096);
+    memory_region region[] = { {.base = 0x1000, .size = 3 * 4096, .content = content} };
+    void* sim = initialize_sim(region, 1);
+    uint8_t instructions[] {
+        0xb7, 0x23, 0x00, 0x00, // lui  x7, 0x2
+        0x23, 0xb0, 0x53, 0x00, // sd   x5, 0(x7)
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    // Host writes are not dirty
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    uint64_t pages[4];
+    uint64_t pages_number = 4;
+    ASSERT_EQUALS(get_dirty_pages(sim, pages, &pages_number), SP_ERR_OK);
+    ASSERT_EQUALS(pages_number, 0);
+    int res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    pages_number = 4;
+    ASSERT_EQUALS(get_dirty_pages(sim, pages, &pages_number), SP_ERR_OK);
+    ASSERT_EQUALS(pages_number, 1);
+    ASSERT_EQUALS(pages[0], 0x2000);
+    // Cleared pages are marked again by the next store
+    ASSERT_EQUALS(clear_dirty_pages(sim), SP_ERR_OK);
+    ASSERT_EQUALS(get_dirty_pages(sim, NULL, &pages_number), SP_ERR_OK);
+    ASSERT_EQUALS(pages_number, 0);
+    res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(get_dirty_pages(sim, NULL, &pages_number), SP_ERR_OK);
+    ASSERT_EQUALS(pages_number, 1);
+    // Teardown
+    release_sim(sim);
+    free(content);
+}
+
+// =====================================
+//              ELF LOADER
+// =====================================
+
+// Stores the size low bytes of value at offset (little-endian)
+void put_bytes(uint8_t* file, size_t offset, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        file[offset + i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+/* Writes the object assembled from asm_examples/infinite_loop_increment.s:
+   a .text section starting with .org 0x1000, then main (addi x6 x6 1; j main)
+*/
+void write_infinite_loop_object(const char* path) {
+    uint8_t file[0x1180] = {};
+    uint8_t code[] = { 0x13, 0x03, 0x13, 0x00, 0x6f, 0xf0, 0xdf, 0xff };
+    // ELF header: ELF64, little-endian, relocatable, RISC-V, 4 section headers at 0x1080
+    memcpy(file, "\177ELF\2\1\1", 7);
+    put_bytes(file, 16, 1, 2);        // e_type
+    put_bytes(file, 18, 243, 2);      // e_machine
+    put_bytes(file, 20, 1, 4);        // e_version
+    put_bytes(file, 40, 0x1080, 8);   // e_shoff
+    put_bytes(file, 52, 64, 2);       // e_ehsize
+    put_bytes(file, 58, 64, 2);       // e_shentsize
+    put_bytes(file, 60, 4, 2);        // e_shnum
+    put_bytes(file, 62, 1, 2);        // e_shstrndx
+    // .text at 0x40, .symtab (null symbol and main) at 0x1048, .strtab at 0x1078
+    memcpy(file + 0x40 + 0x1000, code, sizeof(code));
+    put_bytes(file, 0x1048 + 24, 1, 4);       // st_name
+    put_bytes(file, 0x1048 + 24 + 6, 2, 2);   // st_shndx
+    put_bytes(file, 0x1048 + 24 + 8, 0x1000, 8); // st_value
+    memcpy(file + 0x1078, "\0main", 6);
+    // Section headers: null, .strtab, .text, .symtab
+    size_t strtab = 0x1080 + 64, text = 0x1080 + 128, symtab = 0x1080 + 192;
+    put_bytes(file, strtab + 4, 3, 4);  put_bytes(file, strtab + 24, 0x1078, 8); put_bytes(file, strtab + 32, 6, 8);
+    put_bytes(file, text + 4, 1, 4);    put_bytes(file, text + 8, 6, 8);
+    put_bytes(file, text + 24, 0x40, 8); put_bytes(file, text + 32, 0x1008, 8); put_bytes(file, text + 48, 4, 8);
+    put_bytes(file, symtab + 4, 2, 4);  put_bytes(file, symtab + 24, 0x1048, 8); put_bytes(file, symtab + 32, 48, 8);
+    put_bytes(file, symtab + 40, 1, 4); put_bytes(file, symtab + 44, 1, 4);      put_bytes(file, symtab + 56, 24, 8);
+    FILE* output = fopen(path, "wb");
+    fwrite(file, 1, sizeof(file), output);
+    fclose(output);
+}
+
+void test_load_elf_object() {
+    void* sim = setup_simulation();
+    char path[] = "/tmp/spikelib-test-XXXXXX";
+    close(mkstemp(path));
+    write_infinite_loop_object(path);
+    ASSERT_EQUALS(load_elf(sim, path), SP_ERR_OK);
+    uint64_t main_address;
+    ASSERT_EQUALS(get_symbol_address(sim, "main", &main_address), SP_ERR_OK);
+    ASSERT_EQUALS(main_address, 0x1000);
+    ASSERT_EQUALS(get_symbol_address(sim, "loop", &main_address), SP_ERR_UNKNOWN);
+    const char* name;
+    uint64_t offset;
+    ASSERT_EQUALS(get_address_symbol(sim, 0x1004, &name, &offset), SP_ERR_OK);
+    ASSERT_EQUALS(strcmp(name, "main"), 0);
+    ASSERT_EQUALS(offset, 4);
+    // The loaded code runs as the hand-transcribed one
+    int res = spike_start(sim, main_address, 0, 0, 10);
+    ASSERT_EQUALS(res, SP_ERR_MAX_COUNT);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 5);
+    // Not an ELF file
+    uint8_t garbage[64] = {};
+    FILE* output = fopen(path, "wb");
+    fwrite(garbage, 1, sizeof(garbage), output);
+    fclose(output);
+    ASSERT_EQUALS(load_elf(sim, path), SP_ERR_ELF_INVALID);
+    // Teardown
+    unlink(path);
+    release_sim(sim);
+}
+
+// =====================================
+//            WATCHPOINTS
+// =====================================
+
+void test_watchpoint_stops_on_write() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0xb7, 0x13, 0x00, 0x00, // lui  x7, 0x1
+        0x23, 0xb0, 0x53, 0x10, // sd   x5, 256(x7)
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    // A read watchpoint does not stop the store
+    ASSERT_EQUALS(add_watchpoint(sim, 0x1104, 4, SPIKE_WATCH_READ), SP_ERR_OK);
+    int res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    // A write watchpoint does
+    ASSERT_EQUALS(add_watchpoint(sim, 0x1104, 4, SPIKE_WATCH_WRITE), SP_ERR_OK);
+    res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_WATCHPOINT);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1004);
+    uint64_t address;
+    int kind;
+    get_hit_watchpoint(sim, 0, &address, &kind);
+    ASSERT_EQUALS(address, 0x1100);
+    ASSERT_EQUALS(kind, SPIKE_WATCH_WRITE);
+    // Removed watchpoints no longer stop runs
+    ASSERT_EQUALS(remove_watchpoint(sim, 0x1104, 4, SPIKE_WATCH_WRITE), SP_ERR_OK);
+    res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    // Teardown
+    release_sim(sim);
+}
+
+void test_watchpoint_resumes_over_the_access() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0xb7, 0x13, 0x00, 0x00, // lui  x7, 0x1
+        0x23, 0xb0, 0x53, 0x10, // sd   x5, 256(x7)
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    uint64_t x6_value = 0;
+    write_register(sim, SPIKE_RISCV_REG_X6, &x6_value);
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    ASSERT_EQUALS(add_watchpoint(sim, 0x1100, 8, SPIKE_WATCH_WRITE), SP_ERR_OK);
+    ASSERT_EQUALS(spike_start(sim, 0x1000, 0x100c, 0, 0), SP_ERR_WATCHPOINT);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1004);
+    // The resumed run steps over the store instead of stopping on it again
+    ASSERT_EQUALS(spike_resume(sim, 0), SP_ERR_OK);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x100c);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 1);
+    // Only the first instruction is stepped over, the next run stops again
+    ASSERT_EQUALS(spike_start(sim, 0x1000, 0x100c, 0, 0), SP_ERR_WATCHPOINT);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1004);
+    // Teardown
+    release_sim(sim);
+}
+
+void test_watchpoint_preserves_guest_trap_csrs() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0xb7, 0x13, 0x00, 0x00, // lui  x7, 0x1
+        0x23, 0xb0, 0x53, 0x10, // sd   x5, 256(x7)
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    // State left by a trap the guest is still handling
+    state_t* state = ((sim_t*) sim)->get_core(0)->get_state();
+    state->mepc   = 0x1230;
+    state->mcause = 11;
+    state->mtval  = 0x55;
+    reg_t mstatus = state->mstatus;
+    ASSERT_EQUALS(add_watchpoint(sim, 0x1100, 8, SPIKE_WATCH_WRITE), SP_ERR_OK);
+    ASSERT_EQUALS(spike_start(sim, 0x1000, 0x100c, 0, 0), SP_ERR_WATCHPOINT);
+    ASSERT_EQUALS(state->mepc, 0x1230);
+    ASSERT_EQUALS(state->mcause, 11);
+    ASSERT_EQUALS(state->mtval, 0x55);
+    ASSERT_EQUALS(state->mstatus, mstatus);
+    // Teardown
+    release_sim(sim);
+}
+
+// =====================================
+//            BREAKPOINTS
+// =====================================
+
+void test_breakpoints_stop_runs() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0x13, 0x03, 0x13, 0x00, // addi x6 x6 1
+        0x13, 0x03, 0x13, 0x00, // addi x6 x6 1
+        0x13, 0x03, 0x13, 0x00, // addi x6 x6 1
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    add_breakpoint(sim, 0x1008);
+    add_breakpoint(sim, 0x1100);
+    int res = spike_start(sim, 0x1000, 0x1010, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_BREAKPOINT);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1008);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 2);
+    uint64_t address;
+    get_hit_breakpoint(sim, 0, &address);
+    ASSERT_EQUALS(address, 0x1008);
+    // Starting again from the breakpoint goes past it
+    res = spike_start(sim, 0x1008, 0x1010, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 4);
+    // Without the breakpoint the run reaches the end address
+    ASSERT_EQUALS(remove_breakpoint(sim, 0x1008), SP_ERR_OK);
+    res = spike_start(sim, 0x1000, 0x1010, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_X6, 8);
+    // Teardown
+    release_sim(sim);
+}
+
+// =====================================
+//                HOOKS
+// =====================================
+
+typedef struct {
+    int instructions;
+    int writes;
+    int interrupts;
+    uint64_t address;
+    uint64_t value;
+    uint64_t cause;
+} hook_counts;
+
+void count_instruction(void* sim, uint64_t address, uint32_t size, void* user_data) {
+    ((hook_counts*) user_data)->instructions++;
+}
+
+void count_write(void* sim, int type, uint64_t address, int size, uint64_t value, void* user_data) {
+    hook_counts* counts = (hook_counts*) user_data;
+    counts->writes++;
+    counts->address = address;
+    counts->value = value;
+}
+
+void count_interrupt(void* sim, uint64_t cause, void* user_data) {
+    hook_counts* counts = (hook_counts*) user_data;
+    counts->interrupts++;
+    counts->cause = cause;
+}
+
+void test_hooks_see_instructions_and_writes() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0xb7, 0x13, 0x00, 0x00, // lui  x7, 0x1
+        0x23, 0xb0, 0x53, 0x10, // sd   x5, 256(x7)
+        0x13, 0x03, 0x13, 0x00  // addi x6 x6 1
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    uint64_t x5_value = 0x1234;
+    write_register(sim, SPIKE_RISCV_REG_X5, &x5_value);
+    hook_counts counts = {};
+    uint64_t code_hook, write_hook;
+    ASSERT_EQUALS(hook_add(sim, &code_hook, SPIKE_HOOK_CODE, (void*) count_instruction, &counts, 1, 0), SP_ERR_OK);
+    ASSERT_EQUALS(hook_add(sim, &write_hook, SPIKE_HOOK_MEM_WRITE, (void*) count_write, &counts, 0x1100, 0x1107), SP_ERR_OK);
+    int res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    ASSERT_EQUALS(counts.instructions, 3);
+    ASSERT_EQUALS(counts.writes, 1);
+    ASSERT_EQUALS(counts.address, 0x1100);
+    ASSERT_EQUALS(counts.value, 0x1234);
+    // Deleted hooks are no longer called
+    ASSERT_EQUALS(hook_del(sim, code_hook), SP_ERR_OK);
+    ASSERT_EQUALS(hook_del(sim, code_hook), SP_ERR_UNKNOWN);
+    res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    ASSERT_EQUALS(counts.instructions, 3);
+    ASSERT_EQUALS(counts.writes, 2);
+    // Watchpoints stop runs with a trap of the library, hidden from interrupt hooks
+    uint64_t intr_hook;
+    ASSERT_EQUALS(hook_add(sim, &intr_hook, SPIKE_HOOK_INTR, (void*) count_interrupt, &counts, 1, 0), SP_ERR_OK);
+    ASSERT_EQUALS(add_watchpoint(sim, 0x1100, 8, SPIKE_WATCH_WRITE), SP_ERR_OK);
+    res = spike_start(sim, 0x1000, 0x100c, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_WATCHPOINT);
+    ASSERT_EQUALS(counts.interrupts, 0);
+    ASSERT_EQUALS(remove_watchpoint(sim, 0x1100, 8, SPIKE_WATCH_WRITE), SP_ERR_OK);
+    // Guest traps still reach them (the zeroed memory after the code is illegal)
+    res = spike_start(sim, 0x100c, 0x1200, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_INSN_INVALID);
+    ASSERT_EQUALS(counts.interrupts, 1);
+    ASSERT_EQUALS(counts.cause, 2);
+    // Teardown
+    release_sim(sim);
+}
+
+int claim_fixed_access(void* sim, int error, uint64_t address, void* user_data) {
+    (*(int*) user_data)++;
+    return 1;
+}
+
+void test_invalid_memory_hook_retries_are_bounded() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0xb7, 0x03, 0x01, 0x00, // lui x7 0x10
+        0x83, 0xb2, 0x03, 0x00  // ld  x5 0(x7)
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    int calls = 0;
+    uint64_t invalid_hook;
+    ASSERT_EQUALS(hook_add(sim, &invalid_hook, SPIKE_HOOK_MEM_INVALID, (void*) claim_fixed_access, &calls, 1, 0), SP_ERR_OK);
+    // The hook claims to fix the access but never does
+    int res = spike_start(sim, 0x1000, 0x1200, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_READ_UNMAPPED);
+    ASSERT_EQUALS(calls, 17);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1004);
+    // Teardown
+    release_sim(sim);
+}
+
+void test_trap_delegated_to_supervisor() {
+    void* sim = setup_simulation();
+    uint8_t instructions[] {
+        0x93, 0x02, 0xf0, 0xff, // li    x5, -1
+        0x73, 0x90, 0x02, 0x3b, // csrw  pmpaddr0, x5
+        0x93, 0x02, 0xf0, 0x00, // li    x5, 0xf (TOR, RWX)
+        0x73, 0x90, 0x02, 0x3a, // csrw  pmpcfg0, x5
+        0x93, 0x02, 0x00, 0x02, // li    x5, 0x20 (load access fault)
+        0x73, 0x90, 0x22, 0x30, // csrw  medeleg, x5
+        0xb7, 0x12, 0x00, 0x00, // lui   x5, 0x1
+        0x93, 0x82, 0x02, 0x10, // addi  x5, x5, 0x100
+        0x73, 0x90, 0x52, 0x10, // csrw  stvec, x5
+        0xb7, 0x12, 0x00, 0x00, // lui   x5, 0x1
+        0x9b, 0x82, 0x02, 0x80, // addiw x5, x5, -2048 (MPP = S)
+        0x73, 0xa0, 0x02, 0x30, // csrs  mstatus, x5
+        0x97, 0x02, 0x00, 0x00, // auipc x5, 0
+        0x93, 0x82, 0x02, 0x01, // addi  x5, x5, 16
+        0x73, 0x90, 0x12, 0x34, // csrw  mepc, x5
+        0x73, 0x00, 0x20, 0x30, // mret
+        0xb7, 0x03, 0x01, 0x00, // lui   x7, 0x10
+        0x83, 0xb2, 0x03, 0x00  // ld    x5, 0(x7)
+    };
+    write_memory(sim, 0x1000, sizeof(instructions), instructions);
+    // The fault of the supervisor load lands on stvec, not mtvec
+    int res = spike_start(sim, 0x1000, 0x1200, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_READ_UNMAPPED);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1044);
+    // Teardown
+    release_sim(sim);
+}
+
 // =====================================
 //        INVALID MEMORY ACCESSES
 // =====================================
@@ -495,6 +1651,28 @@ void test_invalid_instruction_fetch() {
 }
 
 
+/* STALE EXCEPTION
+================== */
+
+void test_exec_after_exception_ignores_previous_cause() {
+    void* sim = setup_simulation();
+    uint8_t invalid_instruction[] {
+        0x99, 0x99, 0x99, 0x99  // Wrong instruction
+    };
+    uint32_t instr_add = 0x007302B3; // add x5 x6 x7
+    // First run stops on the invalid instruction
+    write_memory(sim, 0x1000, sizeof(invalid_instruction), invalid_instruction);
+    int res = spike_start(sim, 0x1000, 0x1200, 0, 0);
+    ASSERT_EQUALS(res, SP_ERR_INSN_INVALID);
+    // Second run on valid code must not report the previous mcause
+    write_memory(sim, 0x1000, 4, &instr_add);
+    res = spike_start(sim, 0x1000, 0x1004, 0, 0);
+    ASSERT_EQUALS_REGISTER(sim, SPIKE_RISCV_REG_PC, 0x1004);
+    ASSERT_EQUALS(res, SP_ERR_OK);
+    // Teardown
+    release_sim(sim);
+}
+
 
 // =====================================
 //        INVALID MEMORY ACCESSES
@@ -516,11 +1694,19 @@ int main() {
     test_mem_read_8_bytes();
     test_mem_read_10_bytes();
     test_mem_read_misaligned();
+    test_mem_read_write_whole_region();
+
+    // Register file tests
+    test_write_read_register_file();
+    test_register_file_wrong_version();
 
     // Execution tests
     test_exec_add_instruction();
     test_exec_jump_instruction_timeout();
     test_exec_jump_instruction_instruction_number();
+    test_exec_loop_instruction_number_across_batches();
+    test_exec_instruction_number_with_minstret_write();
+    test_exec_sees_write_to_instruction_across_pages();
     test_exec_until_last_does_not_execute_destination();
     
     // Memory errors tests
@@ -532,4 +1718,65 @@ int main() {
     // Instruction tests
     test_invalid_instruction_fetch();
     test_misaligned_instruction_address();
+    test_exec_after_exception_ignores_previous_cause();
+
+    // Snapshot tests
+    test_snapshot_restore_memory_and_registers();
+    test_restore_between_two_snapshots();
+    test_snapshot_sparse_region();
+
+    // Pool tests
+    test_pool_recycles_clean_simulator();
+    test_pool_recycles_stopped_simulator();
+
+    // Multi-hart tests
+    test_multi_hart_concurrent();
+    test_multi_hart_lockstep();
+    test_multi_hart_lockstep_lr_sc();
+    test_invalid_hart_id();
+
+    // Resumed run tests
+    test_resume_runs_in_slices();
+
+    // Asynchronous run tests
+    test_async_run_stops_on_request();
+
+    // Batch run tests
+    test_batch_run_independent_jobs();
+    test_batch_run_floating_point_jobs();
+
+    // Native translation tests
+    test_jit();
+    test_jit_differential();
+
+    // Execution profile tests
+    test_profile_counts_pcs_and_edges();
+    test_profile_keeps_rewritten_code_visible();
+
+    // Instruction trace tests
+    test_trace_records_instructions();
+
+    // Memory mapping tests
+    test_mem_protect_and_unmap();
+    test_sparse_region_commits_on_touch();
+    test_file_backed_region();
+
+    // Dirty page tests
+    test_dirty_pages_track_guest_stores();
+
+    // ELF loader tests
+    test_load_elf_object();
+
+    // Watchpoint tests
+    test_watchpoint_stops_on_write();
+    test_watchpoint_resumes_over_the_access();
+    test_watchpoint_preserves_guest_trap_csrs();
+
+    // Breakpoint tests
+    test_breakpoints_stop_runs();
+
+    // Hook tests
+    test_hooks_see_instructions_and_writes();
+    test_invalid_memory_hook_retries_are_bounded();
+    test_trap_delegated_to_supervisor();
 }
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "spikelib.h"
+
+// =====================================
+//          TRACE FILE READER
+// =====================================
+
+/* Prints a trace written by spike_trace_start, one instruction per line:
+   index, pc, instruction bits, destination register and its value, then
+   the memory address accessed and a trap marker when present.
+   Usage: spikelib-trace-reader <trace file>
+*/
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return 2;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (size_t) file_stat.st_size < sizeof(spike_trace_header)) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return 1;
+    }
+    void* mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    const spike_trace_header* header = (const spike_trace_header*) mapped;
+    if (memcmp(header->magic, SPIKE_TRACE_MAGIC, sizeof(header->magic)) != 0
+            || header->version != SPIKE_TRACE_VERSION
+            || header->record_size != sizeof(spike_trace_record)
+            || header->records_number > (file_stat.st_size - sizeof(spike_trace_header)) / sizeof(spike_trace_record)) {
+        fprintf(stderr, "%s: not a trace file or unsupported version\n", argv[1]);
+        return 1;
+    }
+
+    const spike_trace_record* records = (const spike_trace_record*) (header + 1);
+    for (uint64_t i = 0; i < header->records_number; i++) {
+        const spike_trace_record* record = &records[i];
+        printf("%lu 0x%016lx 0x%08x x%-2u 0x%016lx", i, record->pc, record->bits, record->rd, record->rd_value);
+        if (record->flags & SPIKE_TRACE_MEM) {
+            printf(" mem 0x%016lx", record->mem_address);
+        }
+        if (record->flags & SPIKE_TRACE_TRAP) {
+            printf(" trap");
+        }
+        printf("\n");
+    }
+
+    munmap(mapped, file_stat.st_size);
+    close(fd);
+    return 0;
+}